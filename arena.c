@@ -0,0 +1,51 @@
+//
+// A bump allocator for the index.
+//
+
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 8
+
+void arena_init(struct arena *a, size_t chunk_size, enum huge_pages huge) {
+    a->head = NULL;
+    if (chunk_size == 0)
+        chunk_size = huge == HUGE_PAGES_OFF ? ARENA_CHUNK_SIZE : HUGE_PAGE_SIZE;
+    a->chunk_size = chunk_size;
+    a->bytes = 0;
+    a->huge = huge;
+    memset(&a->usage, 0, sizeof(a->usage));
+}
+
+void *arena_alloc(struct arena *a, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    struct arena_chunk *c = a->head;
+    if (c == NULL || c->size - c->used < size) {
+        // an allocation bigger than a chunk gets a chunk of its own. The header comes
+        // out of the chunk, so a chunk is exactly a huge page.
+        size_t csize = size + sizeof(*c) > a->chunk_size ? size : a->chunk_size - sizeof(*c);
+        c = huge_alloc(sizeof(*c) + csize, a->huge, &a->usage);
+        if (c == NULL)
+            return NULL;
+        c->size = csize;
+        c->used = 0;
+        c->next = a->head;
+        a->head = c;
+        a->bytes += sizeof(*c) + csize;
+    }
+    void *p = c->data + c->used;
+    c->used += size;
+    return p;
+}
+
+void arena_free(struct arena *a) {
+    struct arena_chunk *c = a->head;
+    while (c != NULL) {
+        struct arena_chunk *next = c->next;
+        huge_free(c, sizeof(*c) + c->size, a->huge);
+        c = next;
+    }
+    a->head = NULL;
+    a->bytes = 0;
+}
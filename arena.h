@@ -0,0 +1,49 @@
+//
+// A bump allocator for the index.
+//
+// Every index element lives until the run ends, so rather than one malloc() per ID we
+// carve them out of large chunks and free the chunks together at the end. The chunks can
+// be backed by huge pages (see hugemem.h), and are then a huge page each.
+//
+
+#ifndef FASTQ_PAIR_ARENA_H
+#define FASTQ_PAIR_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "hugemem.h"
+
+#define ARENA_CHUNK_SIZE (1 << 20)
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+struct arena {
+    struct arena_chunk *head;   // the chunk we are allocating from
+    size_t chunk_size;
+    uint64_t bytes;             // the size of all the chunks
+    enum huge_pages huge;       // how the chunks are backed
+    struct huge_usage usage;    // and what we got
+};
+
+/*
+ * Start an empty arena. chunk_size is the size of each chunk, 0 for ARENA_CHUNK_SIZE, or
+ * HUGE_PAGE_SIZE if the chunks are backed by huge pages.
+ */
+void arena_init(struct arena *a, size_t chunk_size, enum huge_pages huge);
+
+/*
+ * size bytes, aligned for any of our structures. NULL if we can't get a new chunk.
+ */
+void *arena_alloc(struct arena *a, size_t size);
+
+/*
+ * Free every chunk. The arena can be used again afterwards.
+ */
+void arena_free(struct arena *a);
+
+#endif //FASTQ_PAIR_ARENA_H
@@ -0,0 +1,293 @@
+//
+// Generate a synthetic pair of fastq files to benchmark fastq_pair.
+//
+// Every read number k (1..n) is a fragment. A fragment is in both files with probability
+// given by -p, otherwise it is a single in one of the two files. Each record may be written
+// twice in a row (-d). Everything is derived from the seed and k, so the files can be
+// written in any order without keeping state, and the same options always give the same
+// files.
+//
+// To compile this code on its own, you can just use: gcc -std=gnu99 -O2 -o fastq_generate bench/fastq_generate.c -lz
+//
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+enum order { CO_ORDERED, SHUFFLED, SORTED };
+enum header { ILLUMINA, SRA, SLASH, UNDERSCORE, DOT };
+
+struct gen_options {
+    uint64_t reads;
+    int length;
+    double pairing;
+    double duplicates;
+    enum order order;
+    enum header header;
+    int compression;  // 0 is plain text, otherwise the gzip level
+    uint64_t seed;
+};
+
+// one writer per output file so that plain and gzip output look the same to the generator
+struct writer {
+    FILE *fp;
+    gzFile gz;
+    char *buf;
+    size_t used;
+    uint64_t records;
+};
+
+#define WRITER_BUFSIZE (1 << 20)
+
+static uint64_t splitmix64(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// a uniform number in [0, 1) from a 64 bit hash
+static double unit(uint64_t h) {
+    return (h >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * A bijection on [0, n) from a four round Feistel network on the smallest even number of bits
+ * that covers n. Values that land outside the range are fed back in (cycle walking).
+ */
+static uint64_t permute(uint64_t x, uint64_t n, uint64_t seed) {
+    int bits = 2;
+    while (bits < 64 && (1ULL << bits) < n)
+        bits += 2;
+    int half = bits / 2;
+    uint64_t mask = (1ULL << half) - 1;
+    do {
+        uint64_t left = x >> half, right = x & mask;
+        for (int r = 0; r < 4; r++) {
+            uint64_t t = left ^ (splitmix64(right ^ seed ^ ((uint64_t) r << 56)) & mask);
+            left = right;
+            right = t;
+        }
+        x = (left << half) | right;
+    } while (x >= n);
+    return x;
+}
+
+/*
+ * The read number after k when 1..n are listed in lexicographic order (1, 10, 100, 101, ..., 2, 20 ...)
+ */
+static uint64_t next_lexicographic(uint64_t k, uint64_t n) {
+    if (k * 10 <= n)
+        return k * 10;
+    while (k % 10 == 9 || k + 1 > n)
+        k /= 10;
+    return k + 1;
+}
+
+static void writer_open(struct writer *w, const char *fn, int compression) {
+    memset(w, 0, sizeof(*w));
+    if (compression > 0) {
+        char mode[4] = {'w', 'b', (char) ('0' + compression), '\0'};
+        if ((w->gz = gzopen(fn, mode)) == NULL) {
+            fprintf(stderr, "Can't open file %s\n", fn);
+            exit(1);
+        }
+    } else if ((w->fp = fopen(fn, "w")) == NULL) {
+        fprintf(stderr, "Can't open file %s\n", fn);
+        exit(1);
+    }
+    w->buf = malloc(WRITER_BUFSIZE);
+    if (w->buf == NULL) {
+        fprintf(stderr, "Can't allocate the output buffer\n");
+        exit(1);
+    }
+}
+
+static void writer_flush(struct writer *w) {
+    if (w->used == 0)
+        return;
+    if (w->gz != NULL)
+        gzwrite(w->gz, w->buf, (unsigned) w->used);
+    else
+        fwrite(w->buf, 1, w->used, w->fp);
+    w->used = 0;
+}
+
+static void writer_close(struct writer *w) {
+    writer_flush(w);
+    if (w->gz != NULL)
+        gzclose(w->gz);
+    else
+        fclose(w->fp);
+    free(w->buf);
+}
+
+static void write_header(struct writer *w, struct gen_options *o, uint64_t k, int mate) {
+    char *p = w->buf + w->used;
+    switch (o->header) {
+        case ILLUMINA:
+            p += sprintf(p, "@A00123:456:HXXXXDSXY:%d:%d:%llu:%llu %d:N:0:ATCACG\n", (int) (1 + k % 4),
+                         (int) (1101 + (k / 4) % 80), (unsigned long long) (1000 + (k * 7919) % 30000),
+                         (unsigned long long) k, mate);
+            break;
+        case SRA:
+            p += sprintf(p, "@SRR1234567.%llu %llu length=%d\n", (unsigned long long) k, (unsigned long long) k,
+                         o->length);
+            break;
+        case SLASH:
+            p += sprintf(p, "@read%llu/%d\n", (unsigned long long) k, mate);
+            break;
+        case UNDERSCORE:
+            p += sprintf(p, "@read%llu_%d\n", (unsigned long long) k, mate);
+            break;
+        case DOT:
+            p += sprintf(p, "@read%llu.%d\n", (unsigned long long) k, mate);
+            break;
+    }
+    w->used = p - w->buf;
+}
+
+static void write_record(struct writer *w, struct gen_options *o, uint64_t k, int mate) {
+    static const char bases[4] = {'A', 'C', 'G', 'T'};
+    static const char quals[4] = {'F', 'F', ':', ','};
+
+    if (w->used + 2 * o->length + 256 > WRITER_BUFSIZE)
+        writer_flush(w);
+    write_header(w, o, k, mate);
+
+    char *seq = w->buf + w->used;
+    char *qual = seq + o->length + 3;
+    uint64_t state = splitmix64(o->seed ^ (k << 1) ^ (uint64_t) mate);
+    uint64_t r = 0;
+    for (int i = 0; i < o->length; i++) {
+        if (i % 32 == 0)
+            r = state = splitmix64(state);
+        seq[i] = bases[r & 3];
+        qual[i] = quals[(r >> 2) & 3];
+        r >>= 2;
+    }
+    seq[o->length] = '\n';
+    seq[o->length + 1] = '+';
+    seq[o->length + 2] = '\n';
+    qual[o->length] = '\n';
+    w->used += 2 * o->length + 4;
+    w->records++;
+}
+
+/*
+ * Write fragment k to the file for mate (1 or 2) if it belongs there, possibly twice
+ */
+static void emit(struct writer *w, struct gen_options *o, uint64_t k, int mate) {
+    uint64_t h = splitmix64(o->seed + k);
+    bool in_file;
+    if (unit(h) < o->pairing)
+        in_file = true;
+    else
+        in_file = (h & 1) == (uint64_t) (mate - 1);
+    if (!in_file)
+        return;
+    write_record(w, o, k, mate);
+    if (unit(splitmix64(h ^ (uint64_t) mate)) < o->duplicates)
+        write_record(w, o, k, mate);
+}
+
+static void write_file(const char *fn, struct gen_options *o, int mate) {
+    struct writer w;
+    writer_open(&w, fn, o->compression);
+    if (o->order == SORTED) {
+        for (uint64_t k = 1, i = 0; i < o->reads; i++, k = next_lexicographic(k, o->reads))
+            emit(&w, o, k, mate);
+    } else if (o->order == SHUFFLED && mate == 2) {
+        for (uint64_t i = 0; i < o->reads; i++)
+            emit(&w, o, 1 + permute(i, o->reads, o->seed), mate);
+    } else {
+        for (uint64_t k = 1; k <= o->reads; k++)
+            emit(&w, o, k, mate);
+    }
+    fprintf(stderr, "Wrote %llu records to %s\n", (unsigned long long) w.records, fn);
+    writer_close(&w);
+}
+
+void help(char *s) {
+    fprintf(stdout, "\n%s [options] [output prefix]\n", s);
+    fprintf(stdout, "\nWrites [output prefix]_1.fastq and [output prefix]_2.fastq (with .gz if compressed)\n");
+    fprintf(stdout, "\nOPTIONS\n");
+    fprintf(stdout, "-n number of fragments (default 1000000)\n");
+    fprintf(stdout, "-l read length (default 150)\n");
+    fprintf(stdout, "-p fraction of fragments that are in both files (default 0.9)\n");
+    fprintf(stdout, "-d fraction of records that are written twice (default 0)\n");
+    fprintf(stdout, "-o order of the files: coordered, shuffled (the second file is permuted) or sorted (lexicographic read numbers) (default coordered)\n");
+    fprintf(stdout, "-h header style: illumina, sra, slash (/1 /2), underscore (_1 _2) or dot (.1 .2) (default illumina)\n");
+    fprintf(stdout, "-z gzip compression level, 0 for plain text (default 0)\n");
+    fprintf(stdout, "-s random seed (default 42)\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct gen_options o = {1000000, 150, 0.9, 0, CO_ORDERED, ILLUMINA, 0, 42};
+    char *prefix = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            o.reads = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+            o.length = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+            o.pairing = atof(argv[++i]);
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+            o.duplicates = atof(argv[++i]);
+        else if (strcmp(argv[i], "-z") == 0 && i + 1 < argc)
+            o.compression = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            o.seed = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "coordered") == 0)
+                o.order = CO_ORDERED;
+            else if (strcmp(argv[i], "shuffled") == 0)
+                o.order = SHUFFLED;
+            else if (strcmp(argv[i], "sorted") == 0)
+                o.order = SORTED;
+            else {
+                fprintf(stderr, "ERROR: Unknown order %s\n", argv[i]);
+                exit(-1);
+            }
+        } else if (strcmp(argv[i], "-h") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "illumina") == 0)
+                o.header = ILLUMINA;
+            else if (strcmp(argv[i], "sra") == 0)
+                o.header = SRA;
+            else if (strcmp(argv[i], "slash") == 0)
+                o.header = SLASH;
+            else if (strcmp(argv[i], "underscore") == 0)
+                o.header = UNDERSCORE;
+            else if (strcmp(argv[i], "dot") == 0)
+                o.header = DOT;
+            else {
+                fprintf(stderr, "ERROR: Unknown header style %s\n", argv[i]);
+                exit(-1);
+            }
+        } else if (prefix == NULL)
+            prefix = argv[i];
+        else
+            fprintf(stderr, "\n\nERROR: Not sure what parameter %s is\n", argv[i]);
+    }
+
+    if (prefix == NULL || o.reads == 0 || o.length <= 0 || o.length > WRITER_BUFSIZE / 4 ||
+        o.compression < 0 || o.compression > 9) {
+        help(argv[0]);
+        exit(-1);
+    }
+
+    size_t len = strlen(prefix) + 32;
+    char *fn = malloc(len);
+    for (int mate = 1; mate <= 2; mate++) {
+        snprintf(fn, len, "%s_%d.fastq%s", prefix, mate, o.compression > 0 ? ".gz" : "");
+        write_file(fn, &o, mate);
+    }
+    free(fn);
+    return 0;
+}
@@ -0,0 +1,441 @@
+//
+// Microbenchmarks for the hot kernels of fastq_pair.
+//
+// Each benchmark runs once to warm up and then -r times. We report the best and the median
+// time per operation and the throughput of the median run, so that a kernel can be changed
+// and measured on its own without running a whole pairing job.
+//
+
+#include "fastq_pair.h"
+#include "idloc.h"
+#include "fqio.h"
+#include "static_index.h"
+#include "idcode.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct bench_data {
+    int n;                  // number of records
+    char **headers;         // header lines, with the newline
+    char **ids;             // normalised ids
+    char **missing;         // normalised ids that are not in the table
+    uint64_t header_bytes;
+    uint64_t id_bytes;
+    struct fq_line scratch; // the lines we read
+    struct id_rule rule;    // the headers end with /1
+    struct id_codec codec;  // trained on the first ids
+    char plain_fn[4096];
+    char gz_fn[4096];
+    char out_fn[4096];
+    uint64_t file_bytes;
+    long *positions;        // record starts in the plain and gzipped files, in a random order
+    int seeks_plain;
+    int seeks_gz;
+    struct idloc **table;
+    struct arena elements;  // the table elements
+    uint64_t tablesize;
+    enum huge_pages huge;   // how the table and the elements are backed
+    struct static_index sidx;   // the --index mphf index of the ids
+    unsigned sink;          // stops the compiler from throwing the work away
+};
+
+typedef uint64_t (*bench_fn)(struct bench_data *d);
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Time fn. reset (which may be NULL) is called before every run and is not timed.
+ * fn returns the number of bytes it processed.
+ */
+static void run_bench(const char *name, bench_fn fn, bench_fn reset, struct bench_data *d, uint64_t ops, int reps) {
+    double *times = malloc(sizeof(double) * reps);
+    uint64_t bytes = 0;
+    for (int r = -1; r < reps; r++) {
+        if (reset != NULL)
+            reset(d);
+        double start = now_ns();
+        bytes = fn(d);
+        double end = now_ns();
+        if (r >= 0)
+            times[r] = end - start;
+    }
+    qsort(times, reps, sizeof(double), compare_doubles);
+    double median = times[reps / 2];
+    fprintf(stdout, "%-34s %12llu %12.2f %12.2f %12.1f\n", name, (unsigned long long) ops, times[0] / ops,
+            median / ops, bytes / (median / 1e9) / 1e6);
+    free(times);
+}
+
+static uint64_t bench_hash(struct bench_data *d) {
+    for (int i = 0; i < d->n; i++)
+        d->sink ^= hash(d->ids[i]);
+    return d->id_bytes;
+}
+
+static uint64_t bench_copy(struct bench_data *d) {
+    for (int i = 0; i < d->n; i++) {
+        strcpy(d->scratch.buf, d->headers[i]);
+        d->sink ^= (unsigned char) d->scratch.buf[0];
+    }
+    return d->header_bytes;
+}
+
+static uint64_t bench_normalise(struct bench_data *d) {
+    for (int i = 0; i < d->n; i++) {
+        normalise_id(&d->rule, d->headers[i], strlen(d->headers[i]), d->scratch.buf);
+        d->sink ^= (unsigned char) d->scratch.buf[0];
+    }
+    return d->header_bytes;
+}
+
+static uint64_t bench_encode(struct bench_data *d) {
+    for (int i = 0; i < d->n; i++) {
+        id_encode(&d->codec, d->ids[i], strlen(d->ids[i]), d->scratch.buf);
+        d->sink ^= (unsigned char) d->scratch.buf[1];
+    }
+    return d->id_bytes;
+}
+
+static struct fq_stream *open_or_die(const char *fn, const char *mode, bool is_gzip) {
+    struct fq_stream *s = fq_open(fn, mode, is_gzip);
+    if (s == NULL) {
+        fprintf(stderr, "Can't open file %s\n", fn);
+        exit(1);
+    }
+    return s;
+}
+
+static uint64_t read_all(struct bench_data *d, bool is_gzip, const char *fn) {
+    struct fq_stream *s = open_or_die(fn, "r", is_gzip);
+    uint64_t bytes = 0;
+    while (fq_getline(s, &d->scratch) >= 0)
+        bytes += d->scratch.len;
+    fq_close(s);
+    return bytes;
+}
+
+static uint64_t bench_read_plain(struct bench_data *d) {
+    return read_all(d, false, d->plain_fn);
+}
+
+static uint64_t bench_read_gz(struct bench_data *d) {
+    return read_all(d, true, d->gz_fn);
+}
+
+/*
+ * Write every record (the header and three fixed lines) to the output file
+ */
+static uint64_t write_all(struct bench_data *d, bool is_gzip) {
+    static const char *body[3] = {
+            "ACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTAC\n",
+            "+\n",
+            "FFFFFFFFFF:FFFFFFFFFFFFFFFFFFF,FFFFFFFFFFFFFFFFFFFFFFFF:FFFFFFFFFFFFFFFFFFFFFFFFFFF:FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF,FFFFFFFFFFFFFFFFFFFFFFFFFF\n"};
+    struct fq_stream *s = open_or_die(d->out_fn, "w", is_gzip);
+    for (int i = 0; i < d->n; i++) {
+        fq_puts(s, d->headers[i]);
+        for (int j = 0; j < 3; j++)
+            fq_puts(s, body[j]);
+    }
+    fq_close(s);
+    return d->file_bytes;
+}
+
+static uint64_t bench_write_plain(struct bench_data *d) {
+    return write_all(d, false);
+}
+
+static uint64_t bench_write_gz(struct bench_data *d) {
+    return write_all(d, true);
+}
+
+static uint64_t free_table(struct bench_data *d) {
+    if (d->table == NULL)
+        return 0;
+    arena_free(&d->elements);
+    huge_free(d->table, d->tablesize * sizeof(*d->table), d->huge);
+    d->table = NULL;
+    return 0;
+}
+
+static uint64_t bench_insert(struct bench_data *d) {
+    d->table = huge_alloc(d->tablesize * sizeof(*d->table), d->huge, NULL);
+    for (int i = 0; i < d->n; i++)
+        insert_id(&d->elements, &d->table[hash(d->ids[i]) % d->tablesize], d->ids[i], i);
+    return d->id_bytes;
+}
+
+static uint64_t bench_lookup_hit(struct bench_data *d) {
+    for (int i = 0; i < d->n; i++)
+        d->sink ^= find_id(d->table[hash(d->ids[i]) % d->tablesize], d->ids[i]) != NULL;
+    return d->id_bytes;
+}
+
+/*
+ * The lookups as the probe in pair_files() does them: hash a batch and prefetch the
+ * buckets, then prefetch the chains, then compare
+ */
+#define LOOKUP_BATCH 16
+static uint64_t bench_lookup_hit_batched(struct bench_data *d) {
+    uint64_t h[LOOKUP_BATCH];
+    struct idloc *chain[LOOKUP_BATCH];
+    for (int i = 0; i < d->n; i += LOOKUP_BATCH) {
+        int n = d->n - i < LOOKUP_BATCH ? d->n - i : LOOKUP_BATCH;
+        for (int b = 0; b < n; b++) {
+            h[b] = hash(d->ids[i + b]) % d->tablesize;
+            __builtin_prefetch(&d->table[h[b]]);
+        }
+        for (int b = 0; b < n; b++) {
+            chain[b] = d->table[h[b]];
+            if (chain[b] != NULL)
+                __builtin_prefetch(chain[b]);
+        }
+        for (int b = 0; b < n; b++)
+            d->sink ^= find_id(chain[b], d->ids[i + b]) != NULL;
+    }
+    return d->id_bytes;
+}
+
+static uint64_t bench_lookup_miss(struct bench_data *d) {
+    for (int i = 0; i < d->n; i++)
+        d->sink ^= find_id(d->table[hash(d->missing[i]) % d->tablesize], d->missing[i]) != NULL;
+    return d->id_bytes;
+}
+
+static uint64_t free_static(struct bench_data *d) {
+    static_index_free(&d->sidx);
+    return 0;
+}
+
+static uint64_t bench_static_build(struct bench_data *d) {
+    static_index_init(&d->sidx, d->huge);
+    for (int i = 0; i < d->n; i++)
+        static_index_add(&d->sidx, static_index_key(d->ids[i]), i, 0);
+    static_index_build(&d->sidx, (int) sysconf(_SC_NPROCESSORS_ONLN));
+    return d->id_bytes;
+}
+
+static uint64_t bench_static_hit(struct bench_data *d) {
+    for (int i = 0; i < d->n; i++) {
+        uint64_t key = static_index_key(d->ids[i]);
+        d->sink ^= static_index_find(&d->sidx, key, static_index_slot(&d->sidx, key)) != NULL;
+    }
+    return d->id_bytes;
+}
+
+/*
+ * As the probe does them: key a batch and prefetch the first level of the function, then
+ * look up the slots and prefetch them, then check the fingerprints
+ */
+static uint64_t bench_static_hit_batched(struct bench_data *d) {
+    uint64_t key[LOOKUP_BATCH], slot[LOOKUP_BATCH];
+    for (int i = 0; i < d->n; i += LOOKUP_BATCH) {
+        int n = d->n - i < LOOKUP_BATCH ? d->n - i : LOOKUP_BATCH;
+        for (int b = 0; b < n; b++) {
+            key[b] = static_index_key(d->ids[i + b]);
+            mphf_prefetch(&d->sidx.f, key[b]);
+        }
+        for (int b = 0; b < n; b++) {
+            slot[b] = static_index_slot(&d->sidx, key[b]);
+            if (slot[b] != MPHF_NONE)
+                __builtin_prefetch(&d->sidx.slots[slot[b]]);
+        }
+        for (int b = 0; b < n; b++)
+            d->sink ^= static_index_find(&d->sidx, key[b], slot[b]) != NULL;
+    }
+    return d->id_bytes;
+}
+
+static uint64_t bench_static_miss(struct bench_data *d) {
+    for (int i = 0; i < d->n; i++) {
+        uint64_t key = static_index_key(d->missing[i]);
+        d->sink ^= static_index_find(&d->sidx, key, static_index_slot(&d->sidx, key)) != NULL;
+    }
+    return d->id_bytes;
+}
+
+static uint64_t seek_and_read(struct bench_data *d, bool is_gzip, const char *fn, int seeks) {
+    struct fq_stream *s = open_or_die(fn, "rs", is_gzip);
+    uint64_t bytes = 0;
+    for (int i = 0; i < seeks; i++) {
+        fq_seek(s, d->positions[i]);
+        fq_getline(s, &d->scratch);
+        bytes += d->scratch.len;
+    }
+    fq_close(s);
+    return bytes;
+}
+
+static uint64_t bench_seek_plain(struct bench_data *d) {
+    return seek_and_read(d, false, d->plain_fn, d->seeks_plain);
+}
+
+static uint64_t bench_seek_gz(struct bench_data *d) {
+    return seek_and_read(d, true, d->gz_fn, d->seeks_gz);
+}
+
+/*
+ * Make the ids and write them out as a plain and a gzipped fastq file
+ */
+static void setup(struct bench_data *d, const char *dir) {
+    d->headers = malloc(sizeof(char *) * d->n);
+    d->ids = malloc(sizeof(char *) * d->n);
+    d->missing = malloc(sizeof(char *) * d->n);
+    fq_line_init(&d->scratch);
+    fq_line_reserve(&d->scratch, 256);  // room for any header, for the string benchmarks
+    d->positions = malloc(sizeof(long) * d->n);
+    char buf[256];
+    id_rule_init(&d->rule, true);
+    for (int i = 0; i < d->n; i++) {
+        snprintf(buf, sizeof(buf), "@A00123:456:HXXXXDSXY:%d:%d:%d:%d/1\n", 1 + i % 4, 1101 + (i / 4) % 80,
+                 1000 + (i * 7919) % 30000, i);
+        d->headers[i] = strdup(buf);
+        d->header_bytes += strlen(buf);
+        if (i < ID_RULE_RECORDS)
+            id_rule_observe(&d->rule, buf, strlen(buf));
+        normalise_id(&d->rule, buf, strlen(buf), buf);
+        d->ids[i] = strdup(buf);
+        d->id_bytes += strlen(buf);
+        buf[1] = 'B';
+        d->missing[i] = strdup(buf);
+    }
+
+    // train the codec on the first ids, as pair_files does
+    int sample = d->n < ID_RULE_RECORDS ? d->n : ID_RULE_RECORDS;
+    size_t at = 0;
+    for (int i = 0; i < sample; i++) {
+        fq_line_reserve(&d->scratch, at + strlen(d->ids[i]) + 1);
+        strcpy(d->scratch.buf + at, d->ids[i]);
+        at += strlen(d->ids[i]) + 1;
+    }
+    id_codec_train(&d->codec, d->scratch.buf, sample);
+
+    snprintf(d->plain_fn, sizeof(d->plain_fn), "%s/microbench.fastq", dir);
+    snprintf(d->gz_fn, sizeof(d->gz_fn), "%s/microbench.fastq.gz", dir);
+    // write_all() writes to out_fn, so point it at each input file in turn
+    strcpy(d->out_fn, d->plain_fn);
+    write_all(d, false);
+    strcpy(d->out_fn, d->gz_fn);
+    write_all(d, true);
+    snprintf(d->out_fn, sizeof(d->out_fn), "%s/microbench.out", dir);
+
+    struct fq_stream *s = open_or_die(d->plain_fn, "r", false);
+    for (int i = 0; i < d->n; i++) {
+        d->positions[i] = fq_tell(s);
+        for (int j = 0; j < 4; j++)
+            fq_getline(s, &d->scratch);
+    }
+    d->file_bytes = fq_tell(s);
+    fq_close(s);
+
+    // shuffle the positions with a fixed seed so every run seeks in the same order
+    srand(42);
+    for (int i = d->n - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        long t = d->positions[i];
+        d->positions[i] = d->positions[j];
+        d->positions[j] = t;
+    }
+    d->seeks_plain = d->n < 100000 ? d->n : 100000;
+    d->seeks_gz = d->n < 50 ? d->n : 50;
+}
+
+void help(char *s) {
+    fprintf(stdout, "\n%s [options]\n", s);
+    fprintf(stdout, "\nOPTIONS\n");
+    fprintf(stdout, "-n number of ids/records (default 1000000)\n");
+    fprintf(stdout, "-r repetitions of each benchmark (default 5)\n");
+    fprintf(stdout, "-d directory for the temporary files (default $TMPDIR or /tmp)\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct bench_data d;
+    memset(&d, 0, sizeof(d));
+    arena_init(&d.elements, 0, HUGE_PAGES_OFF);
+    d.n = 1000000;
+    int reps = 5;
+    const char *dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            d.n = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            reps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+            dir = argv[++i];
+        else {
+            help(argv[0]);
+            exit(0);
+        }
+    }
+    if (d.n <= 0 || reps <= 0) {
+        help(argv[0]);
+        exit(-1);
+    }
+
+    setup(&d, dir);
+
+    fprintf(stdout, "%-34s %12s %12s %12s %12s\n", "Benchmark", "Ops", "Best ns/op", "Median ns/op", "MB/s");
+    run_bench("hash", bench_hash, NULL, &d, d.n, reps);
+    run_bench("strcpy header (baseline)", bench_copy, NULL, &d, d.n, reps);
+    run_bench("strlen + normalise_id", bench_normalise, NULL, &d, d.n, reps);
+    run_bench("strlen + id_encode", bench_encode, NULL, &d, d.n, reps);
+    run_bench("fq_getline plain (per line)", bench_read_plain, NULL, &d, 4ULL * d.n, reps);
+    run_bench("fq_getline gz (per line)", bench_read_gz, NULL, &d, 4ULL * d.n, reps);
+    run_bench("fq_puts plain (per line)", bench_write_plain, NULL, &d, 4ULL * d.n, reps);
+    run_bench("fq_puts gz (per line)", bench_write_gz, NULL, &d, 4ULL * d.n, reps);
+
+    double loads[] = {0.5, 1, 2, 4, 8};
+    char name[64];
+    for (int l = 0; l < (int) (sizeof(loads) / sizeof(loads[0])); l++) {
+        d.tablesize = (uint64_t) (d.n / loads[l]);
+        if (d.tablesize < 1)
+            d.tablesize = 1;
+        snprintf(name, sizeof(name), "insert_id load %.1f", loads[l]);
+        run_bench(name, bench_insert, free_table, &d, d.n, reps);
+        snprintf(name, sizeof(name), "find_id hit load %.1f", loads[l]);
+        run_bench(name, bench_lookup_hit, NULL, &d, d.n, reps);
+        snprintf(name, sizeof(name), "find_id hit batched load %.1f", loads[l]);
+        run_bench(name, bench_lookup_hit_batched, NULL, &d, d.n, reps);
+        snprintf(name, sizeof(name), "find_id miss load %.1f", loads[l]);
+        run_bench(name, bench_lookup_miss, NULL, &d, d.n, reps);
+        free_table(&d);
+    }
+
+    // load 1 again, with the table and the elements in transparent huge pages
+    d.tablesize = d.n;
+    d.huge = HUGE_PAGES_THP;
+    arena_init(&d.elements, 0, d.huge);
+    run_bench("insert_id load 1.0 thp", bench_insert, free_table, &d, d.n, reps);
+    run_bench("find_id hit load 1.0 thp", bench_lookup_hit, NULL, &d, d.n, reps);
+    run_bench("find_id miss load 1.0 thp", bench_lookup_miss, NULL, &d, d.n, reps);
+    free_table(&d);
+
+    // the minimal perfect hash index, also in transparent huge pages
+    run_bench("mphf build", bench_static_build, free_static, &d, d.n, reps);
+    run_bench("mphf hit", bench_static_hit, NULL, &d, d.n, reps);
+    run_bench("mphf hit batched", bench_static_hit_batched, NULL, &d, d.n, reps);
+    run_bench("mphf miss", bench_static_miss, NULL, &d, d.n, reps);
+    free_static(&d);
+
+    run_bench("fq_seek + read plain", bench_seek_plain, NULL, &d, d.seeks_plain, reps);
+    run_bench("fq_seek + read gz", bench_seek_gz, NULL, &d, d.seeks_gz, reps);
+
+    unlink(d.plain_fn);
+    unlink(d.gz_fn);
+    unlink(d.out_fn);
+    fprintf(stderr, "(checksum %u)\n", d.sink);
+    return 0;
+}
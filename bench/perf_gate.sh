@@ -0,0 +1,148 @@
+#!/bin/sh
+#
+# Performance regression gate for one generated workload.
+#
+# usage: perf_gate.sh [fastq_pair] [fastq_generate] [work directory] [checksum file] [baseline file] [workload]
+#                     [generator options]
+#
+# Generates the workload (once), runs fastq_pair on it with --metrics and compares the
+# checksums of the four output files with the line for this workload in the checksum file.
+# The singles are sorted before they are checksummed because their order depends on the
+# hash table layout, not on what was paired.
+#
+# The throughput and the peak RSS are only compared with the baseline file when PERF_GATE=1
+# is set. They depend on the machine, so the baseline is recorded on the machine that runs
+# the gate (make perf_baseline writes it in the build directory), while the checksums are
+# the same everywhere and live in the source tree.
+#
+# Environment variables:
+#   PERF_GATE                  if set to 1, also compare the throughput and the RSS
+#   PERF_THROUGHPUT_TOLERANCE  fail if records/s drops by more than this fraction (default 0.5)
+#   PERF_RSS_TOLERANCE         fail if the peak RSS grows by more than this fraction (default 0.25)
+#   PERF_UPDATE_BASELINE       if set to 1, replace the line for this workload in the baseline file
+#   PERF_UPDATE_CHECKSUMS      if set to 1, replace the line for this workload in the checksum file
+#
+
+set -e
+
+if [ $# -lt 6 ]; then
+    echo "usage: $0 [fastq_pair] [fastq_generate] [work directory] [checksum file] [baseline file] [workload]" \
+         "[generator options]" >&2
+    exit 1
+fi
+
+FASTQ_PAIR=$1
+GENERATE=$2
+WORK=$3
+CHECKSUMS=$4
+BASELINE=$5
+WORKLOAD=$6
+shift 6
+
+THROUGHPUT_TOLERANCE=${PERF_THROUGHPUT_TOLERANCE:-0.5}
+RSS_TOLERANCE=${PERF_RSS_TOLERANCE:-0.25}
+
+dir="$WORK/$WORKLOAD"
+mkdir -p "$dir"
+suffix=""
+for arg in "$@"; do
+    case "$prev" in
+        -z) [ "$arg" -gt 0 ] && suffix=".gz" ;;
+        -n) reads=$arg ;;
+    esac
+    prev=$arg
+done
+
+if [ ! -f "$dir/reads_1.fastq$suffix" ]; then
+    "$GENERATE" "$@" "$dir/reads" 2> /dev/null
+fi
+rm -f "$dir"/*.paired.fastq* "$dir"/*.single.fastq*
+
+"$FASTQ_PAIR" -t "${reads:-100003}" --metrics "$dir/metrics.json" "$dir/reads_1.fastq$suffix" "$dir/reads_2.fastq$suffix" \
+    > "$dir/stdout.txt" 2> "$dir/stderr.txt"
+
+json_value() {
+    sed -n "s/.*\"$1\": \([0-9.]*\).*/\1/p" "$dir/metrics.json" | head -n 1
+}
+
+# print the contents of a (possibly gzipped) output file, sorted by record if $2 is "sort"
+contents() {
+    if [ -n "$suffix" ]; then
+        gzip -dc "$1"
+    else
+        cat "$1"
+    fi | if [ "$2" = "sort" ]; then paste - - - - | LC_ALL=C sort; else cat; fi
+}
+
+checksum() {
+    {
+        contents "$dir/reads_1.paired.fastq$suffix"
+        contents "$dir/reads_2.paired.fastq$suffix"
+        contents "$dir/reads_1.single.fastq$suffix" sort
+        contents "$dir/reads_2.single.fastq$suffix" sort
+    } | cksum | cut -d ' ' -f 1
+}
+
+records=$(( $(json_value left_records) + $(json_value right_records) ))
+elapsed=$(json_value elapsed_ms)
+rate=$(awk -v n="$records" -v t="$elapsed" 'BEGIN { printf "%.0f", (t > 0 ? n / (t / 1000) : n * 1000) }')
+rss=$(json_value peak_rss_kb)
+sum=$(checksum)
+
+echo "$WORKLOAD: $records records in $elapsed ms ($rate records/s), peak RSS $rss kB, checksum $sum"
+
+# replace the line for this workload in the file $1 with the rest of the arguments
+update() {
+    file=$1
+    shift
+    touch "$file"
+    grep -v "^$WORKLOAD	" "$file" > "$file.tmp" || true
+    (IFS='	'; echo "$WORKLOAD	$*") >> "$file.tmp"
+    LC_ALL=C sort "$file.tmp" > "$file"
+    rm -f "$file.tmp"
+    echo "Updated $WORKLOAD in $file"
+}
+
+if [ "$PERF_UPDATE_CHECKSUMS" = "1" ]; then
+    update "$CHECKSUMS" "$sum"
+fi
+if [ "$PERF_UPDATE_BASELINE" = "1" ]; then
+    update "$BASELINE" "$rate" "$rss"
+fi
+if [ "$PERF_UPDATE_CHECKSUMS" = "1" ] || [ "$PERF_UPDATE_BASELINE" = "1" ]; then
+    exit 0
+fi
+
+status=0
+base_sum=$(grep "^$WORKLOAD	" "$CHECKSUMS" | cut -f 2 || true)
+if [ -z "$base_sum" ]; then
+    echo "FAIL: there is no checksum for $WORKLOAD in $CHECKSUMS (run with PERF_UPDATE_CHECKSUMS=1)"
+    status=1
+elif [ "$sum" != "$base_sum" ]; then
+    echo "FAIL: the output checksum $sum does not match $base_sum"
+    status=1
+fi
+
+if [ "$PERF_GATE" != "1" ]; then
+    [ $status -eq 0 ] && echo "PASS: the outputs match (set PERF_GATE=1 to compare the throughput and the RSS too)"
+    exit $status
+fi
+
+line=$(grep "^$WORKLOAD	" "$BASELINE" 2> /dev/null || true)
+if [ -z "$line" ]; then
+    echo "FAIL: there is no baseline for $WORKLOAD in $BASELINE (run make perf_baseline on this machine)"
+    exit 1
+fi
+base_rate=$(echo "$line" | cut -f 2)
+base_rss=$(echo "$line" | cut -f 3)
+
+if awk -v r="$rate" -v b="$base_rate" -v t="$THROUGHPUT_TOLERANCE" 'BEGIN { exit !(r < b * (1 - t)) }'; then
+    echo "FAIL: throughput $rate records/s is more than $THROUGHPUT_TOLERANCE below the baseline $base_rate"
+    status=1
+fi
+if awk -v r="$rss" -v b="$base_rss" -v t="$RSS_TOLERANCE" 'BEGIN { exit !(r > b * (1 + t)) }'; then
+    echo "FAIL: peak RSS $rss kB is more than $RSS_TOLERANCE above the baseline $base_rss kB"
+    status=1
+fi
+[ $status -eq 0 ] && echo "PASS: the outputs match and we are within the baseline ($base_rate records/s, $base_rss kB)"
+exit $status
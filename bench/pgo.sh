@@ -0,0 +1,82 @@
+#!/bin/sh
+#
+# Profile guided build of fastq_pair.
+#
+# usage: pgo.sh [source directory] [build directory] [fastq_generate] [C compiler]
+#
+# Configures the build directory with FASTQ_PAIR_PGO=GENERATE, builds an instrumented
+# fastq_pair, runs it over generated workloads (plain and gzipped, co-ordered and shuffled,
+# with and without the -d, -f and -s options) and then reconfigures the same directory with
+# FASTQ_PAIR_PGO=USE and rebuilds. The profile is keyed on the object file paths, which is
+# why both builds happen in one directory. The result is [build directory]/fastq_pair.
+#
+# Environment variables:
+#   PGO_READS     reads per plain training workload (default 200000)
+#   PGO_GZ_READS  reads per gzipped training workload (default 2000, shuffled gzip input seeks a lot)
+#
+
+set -e
+
+if [ $# -lt 3 ]; then
+    echo "usage: $0 [source directory] [build directory] [fastq_generate] [C compiler]" >&2
+    exit 1
+fi
+
+# absolute, since we configure from inside the build directory
+SOURCE=$(cd "$1" && pwd)
+mkdir -p "$2"
+BUILD=$(cd "$2" && pwd)
+GENERATE=$3
+COMPILER=${4:-cc}
+READS=${PGO_READS:-200000}
+GZ_READS=${PGO_GZ_READS:-2000}
+PROFILE="$BUILD/pgo-profile"
+WORK="$BUILD/training"
+
+# cmake -S and -B need CMake 3.13, and CMakeLists.txt asks for 3.9
+configure() {
+    (cd "$BUILD" && cmake "$SOURCE" -DCMAKE_BUILD_TYPE=Release -DCMAKE_C_COMPILER="$COMPILER" \
+        -DFASTQ_PAIR_PGO="$1" -DFASTQ_PAIR_PGO_DIR="$PROFILE" > /dev/null)
+    cmake --build "$BUILD" --target fastq_pair
+}
+
+echo "Building the instrumented fastq_pair in $BUILD"
+rm -rf "$PROFILE"
+configure GENERATE
+
+# train: name, fastq_pair options, generator options
+train() {
+    name=$1
+    options=$2
+    shift 2
+    mkdir -p "$WORK"
+    case " $* " in
+        *" -z "*) suffix=".gz" ;;
+        *) suffix="" ;;
+    esac
+    if [ ! -f "$WORK/${name}_1.fastq$suffix" ]; then
+        "$GENERATE" "$@" "$WORK/$name" 2> /dev/null
+    fi
+    echo "Training on $name"
+    # shellcheck disable=SC2086
+    "$BUILD/fastq_pair" $options "$WORK/${name}_1.fastq$suffix" "$WORK/${name}_2.fastq$suffix" > /dev/null 2>&1
+    rm -f "$WORK"/*.paired.fastq* "$WORK"/*.single.fastq*
+}
+
+train plain_coordered "-t $READS" -n "$READS" -o coordered -h slash
+train plain_shuffled "-t $READS -d" -n "$READS" -o shuffled -h illumina -d 0.01
+train plain_shuffled "-t $READS -f" -n "$READS" -o shuffled -h illumina -d 0.01
+train plain_sorted "-t $READS -s" -n "$READS" -o sorted -h sra
+train gz_coordered "-t $GZ_READS" -n "$GZ_READS" -o coordered -h underscore -p 0.99 -z 1
+train gz_shuffled "-t $GZ_READS -d" -n "$GZ_READS" -o shuffled -h slash -d 0.01 -z 1
+
+case "$COMPILER" in
+    *clang*)
+        # clang writes raw profiles that have to be merged first
+        llvm-profdata merge -output="$PROFILE/fastq_pair.profdata" "$PROFILE"/*.profraw
+        ;;
+esac
+
+echo "Rebuilding fastq_pair with the profile in $PROFILE"
+configure USE
+echo "The profile guided fastq_pair is $BUILD/fastq_pair"
@@ -0,0 +1,82 @@
+#!/bin/sh
+#
+# Run fastq_pair over a matrix of generated workloads and record the time, the
+# peak memory and the throughput of each run.
+#
+# usage: run_bench.sh [fastq_pair] [fastq_generate] [work directory]
+#
+# The matrix can be changed with these environment variables (lists are space separated):
+#   BENCH_READS        number of fragments            (default "1000000")
+#   BENCH_ORDERS       coordered, shuffled or sorted  (default "coordered shuffled")
+#   BENCH_HEADERS      illumina, sra, slash ...       (default "illumina slash")
+#   BENCH_COMPRESSION  gzip levels, 0 is plain text   (default "0 1")
+#   BENCH_LENGTH       read length                    (default 150)
+#   BENCH_PAIRING      fraction of paired fragments   (default 0.9)
+#   BENCH_DUPLICATES   fraction of duplicated records (default 0)
+#
+# The results are appended to [work directory]/results.tsv
+#
+
+set -e
+
+if [ $# -lt 3 ]; then
+    echo "usage: $0 [fastq_pair] [fastq_generate] [work directory]" >&2
+    exit 1
+fi
+
+FASTQ_PAIR=$1
+GENERATE=$2
+WORK=$3
+
+READS=${BENCH_READS:-1000000}
+ORDERS=${BENCH_ORDERS:-coordered shuffled}
+HEADERS=${BENCH_HEADERS:-illumina slash}
+COMPRESSION=${BENCH_COMPRESSION:-0 1}
+LENGTH=${BENCH_LENGTH:-150}
+PAIRING=${BENCH_PAIRING:-0.9}
+DUPLICATES=${BENCH_DUPLICATES:-0}
+
+mkdir -p "$WORK"
+RESULTS="$WORK/results.tsv"
+if [ ! -f "$RESULTS" ]; then
+    printf "date\treads\torder\theader\tcompression\tleft_records\tright_records\telapsed_ms\tpeak_rss_kb\trecords_per_s\tmb_per_s\n" > "$RESULTS"
+fi
+
+# pull a number out of the metrics JSON
+json_value() {
+    sed -n "s/.*\"$1\": \([0-9.]*\).*/\1/p" "$2" | head -n 1
+}
+
+for reads in $READS; do
+for order in $ORDERS; do
+for header in $HEADERS; do
+for level in $COMPRESSION; do
+    name="${reads}_${order}_${header}_z${level}"
+    dir="$WORK/$name"
+    suffix=""
+    [ "$level" -gt 0 ] && suffix=".gz"
+    mkdir -p "$dir"
+    if [ ! -f "$dir/reads_1.fastq$suffix" ]; then
+        "$GENERATE" -n "$reads" -l "$LENGTH" -p "$PAIRING" -d "$DUPLICATES" -o "$order" -h "$header" \
+            -z "$level" "$dir/reads" 2> /dev/null
+    fi
+
+    "$FASTQ_PAIR" -t "$reads" --metrics "$dir/metrics.json" "$dir/reads_1.fastq$suffix" "$dir/reads_2.fastq$suffix" \
+        > "$dir/stdout.txt" 2> "$dir/stderr.txt"
+
+    left=$(json_value left_records "$dir/metrics.json")
+    right=$(json_value right_records "$dir/metrics.json")
+    lbytes=$(json_value left_bytes "$dir/metrics.json")
+    rbytes=$(json_value right_bytes "$dir/metrics.json")
+    elapsed=$(json_value elapsed_ms "$dir/metrics.json")
+    rss=$(json_value peak_rss_kb "$dir/metrics.json")
+    rate=$(awk -v n=$((left + right)) -v t="$elapsed" 'BEGIN { printf "%.0f", (t > 0 ? n / (t / 1000) : 0) }')
+    mbps=$(awk -v b=$((lbytes + rbytes)) -v t="$elapsed" 'BEGIN { printf "%.1f", (t > 0 ? b / 1e6 / (t / 1000) : 0) }')
+    printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n" "$(date +%Y-%m-%dT%H:%M:%S)" "$reads" "$order" "$header" \
+        "$level" "$left" "$right" "$elapsed" "$rss" "$rate" "$mbps" | tee -a "$RESULTS"
+
+    rm -f "$dir"/*.paired.fastq* "$dir"/*.single.fastq*
+done
+done
+done
+done
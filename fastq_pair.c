@@ -29,18 +29,38 @@
  *
  * Note that to print out the sequences we seek to the position we recorded and print four lines.
  *
+ * With --order left the second file is the one we index and the first is the one we read through, so the pairs come
+ * out in the order of the first file.
+ *
+ * With --index mphf we keep a position and a fingerprint for each ID instead of the ID itself, looked up through a
+ * minimal perfect hash function that we build once the indexed file has been read (see static_index.h). A match is
+ * confirmed against the ID of the record when we read it back.
+ *
+ * With --shard i/N we only pair the records whose IDs hash to shard i, so that N runs (on N machines) share the work
+ * and each holds a 1/N of the index. merge_shards() puts their outputs together.
+ *
+ * The hash table keeps the IDs coded without the prefix that the IDs of the indexed file share (see idcode.h), when
+ * that makes them smaller.
+ *
  */
 
 #include "is_gzipped.h"
 #include "fastq_pair.h"
-#include "robstr.h"
+#include "idloc.h"
+#include "table_stats.h"
+#include "progress.h"
+#include "fqio.h"
+#include "multiversion.h"
+#include "static_index.h"
+#include "idcode.h"
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <zlib.h>  // Include zlib for gzip handling
+#include <sys/stat.h>
 
 // Function to remove any suffix from a predefined list of possible suffixes
-char* removeSuffix(const char* str) {
+static char* removeSuffix(const char* str) {
     // Define the possible suffixes directly within the function
     const char* suffixes[] = {".fastq", ".fastq.gz", ".fq", "fq.gz"};
     int num_suffixes = sizeof(suffixes) / sizeof(suffixes[0]);
@@ -55,10 +75,8 @@ char* removeSuffix(const char* str) {
         if (str_len >= suffix_len && strcmp(str + str_len - suffix_len, suffixes[i]) == 0) {
             // Allocate memory for the new string (excluding the suffix)
             char* new_str = (char*)malloc((str_len - suffix_len + 1) * sizeof(char));
-            if (new_str == NULL) {
-                fprintf(stderr, "Memory allocation failed\n");
-                exit(1);  // Exit if memory allocation fails
-            }
+            if (new_str == NULL)
+                return NULL;
             // Copy the part of the original string excluding the suffix
             strncpy(new_str, str, str_len - suffix_len);
             new_str[str_len - suffix_len] = '\0';  // Null-terminate the new string
@@ -70,501 +88,1156 @@ char* removeSuffix(const char* str) {
     return new_str;
 }
 
-// Function to write to a regular file or gzip file depending on the flag
-void writeToFile(bool is_gzip, gzFile gz_file, FILE* reg_file, const char* line) {
-    if (is_gzip) {
-        gzprintf(gz_file, "%s", line);  // Write to gzip file
-    } else {
-        fprintf(reg_file, "%s", line);  // Write to regular file
-    }
+// The size of a file on disk, 0 if we can't tell
+static uint64_t file_size(const char *fn) {
+    struct stat st;
+    if (stat(fn, &st) != 0)
+        return 0;
+    return st.st_size;
 }
 
-// Function to read a line from either a regular or gzip file
-char* readFromFile(bool is_gzip, gzFile gz_file, FILE* reg_file, char* line, int max_len) {
-    if (is_gzip) {
-        return gzgets(gz_file, line, max_len);  // Read from gzip file
-    } else {
-        return fgets(line, max_len, reg_file);  // Read from regular file
-    }
+/*
+ * Write the ID with the mate number and a newline appended, for the -f output
+ */
+static void put_formatted_id(struct fq_stream *s, const char *id, const char *suffix) {
+    fq_puts(s, id);
+    fq_puts(s, suffix);
+}
+
+/*
+ * Count a seek into the left file. gzseek() cannot jump, it inflates forward from
+ * where it is, or rewinds to the start of the file and inflates from there, so we
+ * estimate how much data it had to inflate again to reach the record.
+ */
+static void count_seek(struct metrics *m, struct fq_stream *s, long to) {
+    if (m == NULL)
+        return;
+    long from = fq_tell(s);
+    m->counters.left_seeks++;
+    if (fq_compressed(s))
+        m->counters.bytes_reinflated += to >= from ? to - from : to;
+}
+
+void id_rule_init(struct id_rule *rule, bool splitspace) {
+    rule->splitspace = splitspace;
+    rule->sep = 0;
+    rule->mate = 0;
+    rule->casava = false;
+    rule->observed = 0;
+}
+
+// the length without the newline (and carriage return)
+static inline size_t header_length(const char *line, size_t len) {
+    while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+        len--;
+    return len;
 }
 
-// Void function to seek in either a regular or gzip file
-void seekInFile(bool is_gzip, gzFile gz_file, FILE* reg_file, long offset, int whence) {
-    if (is_gzip) {
-        gzseek(gz_file, offset, whence);  // Seek in gzip file
-    } else {
-        fseek(reg_file, offset, whence);  // Seek in regular file
+// where the first word ends
+static inline size_t word_length(const char *line, size_t len) {
+    size_t i = 0;
+    while (i < len && line[i] != ' ' && line[i] != '\t')
+        i++;
+    return i;
+}
+
+void id_rule_observe(struct id_rule *rule, const char *line, size_t len) {
+    /*
+     * We have four examples of how the mates are matched
+     *     i.   using /1 and /2 (or _1 _2, .1 .2)
+     *     ii.  using /f and /r
+     *     iii. using ' 1:N:0...' and ' 2:N:0....' (CASAVA 1.8)
+     *     iv.  just having the whole name
+     */
+    len = header_length(line, len);
+    size_t word = word_length(line, len);
+    char sep = 0, mate = 0;
+    if (word >= 3 && (line[word-2] == '/' || line[word-2] == '_' || line[word-2] == '.') &&
+        (line[word-1] == '1' || line[word-1] == '2' || line[word-1] == 'f' || line[word-1] == 'r')) {
+        sep = line[word-2];
+        mate = line[word-1];
+    }
+    bool casava = word + 3 < len && (line[word+1] == '1' || line[word+1] == '2') && line[word+2] == ':';
+
+    if (rule->observed++ == 0) {
+        rule->sep = sep;
+        rule->mate = mate;
+        rule->casava = casava && !rule->splitspace;
+        return;
     }
+    if (sep != rule->sep || mate != rule->mate)
+        rule->sep = rule->mate = 0;
+    if (!casava)
+        rule->casava = false;
+}
+
+const char *id_rule_name(const struct id_rule *rule, char *buf, size_t size) {
+    if (rule->sep != 0)
+        snprintf(buf, size, "%c%c suffix%s", rule->sep, rule->mate, rule->casava ? " and CASAVA comment" : "");
+    else
+        snprintf(buf, size, "%s", rule->casava ? "CASAVA comment" : "no mate suffix");
+    return buf;
 }
 
-// Function to get the current position in either a regular or gzip file
-long int tellInFile(bool is_gzip, gzFile gz_file, FILE* reg_file) {
-    if (is_gzip) {
-        return gztell(gz_file);  // Get position in gzip file
-    } else {
-        return ftell(reg_file);  // Get position in regular file
+HOT_KERNEL size_t normalise_id(const struct id_rule *rule, const char *line, size_t len, char *id) {
+    len = header_length(line, len);
+    size_t word = word_length(line, len);
+    size_t n = word;
+    if (rule->sep != 0 && word >= 3 && line[word-1] == rule->mate && line[word-2] == rule->sep)
+        n -= 2;
+    memmove(id, line, n);
+    if (!rule->splitspace && word < len) {
+        // keep the comment, without the mate number if it is a CASAVA one
+        size_t skip = rule->casava && word + 3 < len && (line[word+1] == '1' || line[word+1] == '2') &&
+                      line[word+2] == ':' ? 1 : 0;
+        id[n++] = line[word];
+        memmove(id + n, line + word + 1 + skip, len - word - 1 - skip);
+        n += len - word - 1 - skip;
     }
+    id[n] = '\0';
+    return n;
 }
 
-int pair_files(char *left_fn, char *right_fn, struct options *opt) {
+HOT_KERNEL struct idloc *find_id(struct idloc *ptr, const char *id) {
+    size_t len = strlen(id);
+    while (ptr != NULL) {
+        if (idloc_matches(ptr, id, len))
+            return ptr;
+        ptr = ptr->next;
+    }
+    return NULL;
+}
 
-    int left_duplicates_counter=0;
-    int right_duplicates_counter=0;
-    int left_paired_counter=0;
-    int right_paired_counter=0;
-    int left_single_counter=0;
-    int right_single_counter=0;
+struct idloc *insert_id(struct arena *a, struct idloc **bucket, const char *id, long int pos) {
+    size_t len = strlen(id);
+    if (len > UINT32_MAX)
+        return NULL;
+    size_t spill = len < IDLOC_INLINE ? 0 : len + 1 - IDLOC_INLINE;
+    struct idloc *newid = arena_alloc(a, IDLOC_SLOT_BYTES + spill);
+    if (newid == NULL)
+        return NULL;
+    memcpy(newid->id, id, len + 1);
+    newid->idlen = (uint32_t) len;
+    newid->pos = pos;
+    newid->len = 0;
+    newid->printed = false;
+    newid->next = *bucket;  // Insert at the head of the list
+    *bucket = newid;
+    return newid;
+}
 
-    // Hash table for the first file (left)
-    struct idloc **ids_left;
-    ids_left = malloc(sizeof(*ids_left) * opt->tablesize);
-    if (ids_left == NULL) {
-        fprintf(stderr, "We cannot allocate the memory for a table size of the first file %d. Please try a smaller value for -t\n", opt->tablesize);
-        exit(-1);
+/*
+ * Record what went wrong in the result and return the error code
+ */
+static int pair_error(struct pair_result *res, int err, const char *fmt, ...) {
+    if (res != NULL) {
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(res->error, sizeof(res->error), fmt, ap);
+        va_end(ap);
     }
-    // Only allocate memory for ids_right if deduplication is used
-    struct idloc **ids_right;
-    if (opt->deduplicate) {
-        // Hash table for the first file (right)
-        ids_right = malloc(sizeof(*ids_right) * opt->tablesize);
-        if (ids_right == NULL) {
-            fprintf(stderr, "We cannot allocate the memory for a table size of the second file %d. Please try a smaller value for -t\n", opt->tablesize);
-            exit(-1);
+    return err;
+}
+
+/*
+ * Free the table. The elements live in the arena, so we only walk the chains to keep
+ * the memory accounting straight.
+ */
+static void free_table(struct idloc **table, uint64_t tablesize, enum huge_pages huge, struct metrics *m) {
+    if (table == NULL)
+        return;
+    if (m != NULL) {
+        for (uint64_t i = 0; i < tablesize; i++) {
+            for (struct idloc *ptr = table[i]; ptr != NULL; ptr = ptr->next) {
+                mem_release(m, MEM_INDEX, IDLOC_SLOT_BYTES);
+                mem_release(m, MEM_IDS, idloc_spill_bytes(ptr));
+            }
         }
     }
+    huge_free(table, sizeof(*table) * tablesize, huge);
+    mem_release(m, MEM_INDEX, sizeof(*table) * tablesize);
+}
 
-    FILE *lfp, *rfp;
-    gzFile lfp_gz, rfp_gz;
-    bool is_gzip_left, is_gzip_right;
-    bool is_gzip_out = false;
+/*
+ * An empty table, NULL if there isn't the memory for it
+ */
+static struct idloc **alloc_table(uint64_t tablesize, enum huge_pages huge, struct huge_usage *u) {
+    if (tablesize > SIZE_MAX / sizeof(struct idloc *))
+        return NULL;
+    return huge_alloc(tablesize * sizeof(struct idloc *), huge, u);
+}
 
-    is_gzip_left = test_gzip(left_fn);
-    is_gzip_right = test_gzip(right_fn);
-    if (is_gzip_left || is_gzip_right) {
-        is_gzip_out = true;
+/*
+ * Work out the ID rule from the first records of a file, and go back to the start
+ */
+static void detect_id_rule(struct fq_stream *s, struct fq_line *line, bool splitspace, struct id_rule *rule) {
+    id_rule_init(rule, splitspace);
+    for (long n = 0; n < 4 * ID_RULE_RECORDS && fq_getline(s, line) >= 0; n++)
+        if (n % 4 == 0)
+            id_rule_observe(rule, line->data, line->len);
+    fq_seek(s, 0);
+}
+
+/*
+ * Normalise the header in line into key, growing key to fit. Returns -1 if we can't.
+ */
+static int record_key(const struct id_rule *rule, const struct fq_line *line, struct fq_line *key) {
+    if (fq_line_reserve(key, line->len + 1) != 0)
+        return -1;
+    key->len = normalise_id(rule, line->data, line->len, key->buf);
+    key->data = key->buf;
+    return 0;
+}
+
+/*
+ * Whether the record with this ID is one we pair in this run. The shard comes from a
+ * different hash than the bucket, so the records of a shard still spread over the table.
+ */
+static inline bool in_shard(const struct options *opt, const char *id) {
+    return opt->nshards <= 1 || mphf_key(id) % opt->nshards == opt->shard;
+}
+
+/*
+ * Work out how to code the IDs of a file from its first records, and go back to the start
+ */
+static void detect_id_codec(struct fq_stream *s, struct fq_line *line, const struct id_rule *rule,
+                            struct fq_line *key, struct id_codec *codec) {
+    struct fq_line sample;      // the IDs, one after the other
+    fq_line_init(&sample);
+    sample.len = 0;
+    int n = 0;
+    for (long l = 0; l < 4 * ID_RULE_RECORDS && fq_getline(s, line) >= 0; l++) {
+        if (l % 4 != 0)
+            continue;
+        if (record_key(rule, line, key) != 0 || fq_line_reserve(&sample, sample.len + key->len + 1) != 0)
+            break;
+        memcpy(sample.buf + sample.len, key->buf, key->len + 1);
+        sample.len += key->len + 1;
+        n++;
     }
+    id_codec_train(codec, sample.buf, n);
+    fq_line_free(&sample);
+    fq_seek(s, 0);
+}
 
-    fprintf(stderr, "First file is gzipped: %s\n", is_gzip_left ? "true" : "false");
-    fprintf(stderr, "Second file is gzipped: %s\n", is_gzip_right ? "true" : "false");
-    fprintf(stderr, "Output files will be gzipped: %s\n", is_gzip_out ? "true" : "false");
+/*
+ * The ID that we keep in the hash table for key: its code, in code, if the codec is on, and
+ * otherwise key itself. The length goes in len. Returns NULL if we can't get the memory.
+ */
+static const char *table_id(const struct id_codec *codec, const struct fq_line *key, struct fq_line *code, size_t *len) {
+    if (!codec->enabled) {
+        *len = key->len;
+        return key->buf;
+    }
+    if (fq_line_reserve(code, 2 * key->len + 2) != 0)
+        return NULL;
+    *len = id_encode(codec, key->buf, key->len, code->buf);
+    return code->buf;
+}
 
-    char *line = malloc(sizeof(char) * MAXLINELEN + 1);
+/*
+ * The ID of an element of the hash table, decoded into buf if need be. NULL if we can't get the memory.
+ */
+static const char *element_id(const struct id_codec *codec, const struct idloc *rec, struct fq_line *buf) {
+    if (!codec->enabled)
+        return rec->id;
+    if (fq_line_reserve(buf, id_decoded_max(codec, rec->idlen) + 1) != 0)
+        return NULL;
+    buf->len = id_decode(codec, rec->id, buf->buf);
+    return buf->buf;
+}
 
-    if (is_gzip_left){
-        if ((lfp_gz = gzopen(left_fn, "rb")) == NULL) {
-                fprintf(stderr, "Can't open file %s\n", left_fn);
-                exit(1);
-        }
-    } else {
-        if ((lfp = fopen(left_fn, "r")) == NULL) {
-                fprintf(stderr, "Can't open file %s\n", left_fn);
-                exit(1);
+/*
+ * Copy the left record at rec to out, through buf. With -f (suffix is not NULL) the
+ * header is replaced by id and the suffix. We know the length of most records, so
+ * they are one read and one write; the rest are read a line at a time. Returns the bytes
+ * we read, or -1 if the record isn't there any more.
+ */
+static long fetch_record(struct fq_stream *in, const struct idloc *rec, const char *id, struct fq_line *buf,
+                         struct fq_stream *out, const char *suffix) {
+    if (fq_seek(in, rec->pos) != 0)
+        return -1;
+    if (rec->len != 0) {
+        if (fq_read(in, buf, rec->len) != 0)
+            return -1;
+        const char *data = buf->data;
+        size_t len = buf->len;
+        if (suffix != NULL) {
+            const char *nl = memchr(data, '\n', len);
+            size_t skip = nl != NULL ? (size_t) (nl - data) + 1 : len;
+            put_formatted_id(out, id, suffix);
+            data += skip;
+            len -= skip;
         }
+        fq_write(out, data, len);
+        return rec->len;
+    }
+    long bytes = 0;
+    for (int i = 0; i <= 3; i++) {
+        if (fq_getline(in, buf) < 0)
+            return -1;
+        bytes += buf->len;
+        if (i == 0 && suffix != NULL)
+            put_formatted_id(out, id, suffix);
+        else
+            fq_write(out, buf->data, buf->len);
     }
-    char *aline; /* this variable is not used, it suppresses a compiler warning */
+    return bytes;
+}
 
-    long int nextposition = 0;
+/*
+ * Copy the record in slot s of a static index to out, as fetch_record does, but only if
+ * its ID is expect (unless that is NULL). The index only has the ID's fingerprint, so this
+ * is where we make sure that the record is the mate. The ID goes in key. Returns the bytes
+ * we read, 0 if the ID is not expect (and nothing was written), or -1 if the record isn't
+ * there any more.
+ */
+static long fetch_static(struct fq_stream *in, const struct static_slot *s, const struct id_rule *rule,
+                         const char *expect, struct fq_line *buf, struct fq_line *key,
+                         struct fq_stream *out, const char *suffix) {
+    if (fq_seek(in, s->pos) != 0 || fq_getline(in, buf) < 0 || record_key(rule, buf, key) != 0)
+        return -1;
+    if (expect != NULL && strcmp(key->buf, expect) != 0)
+        return 0;
+    long bytes = buf->len;
+    if (suffix != NULL)
+        put_formatted_id(out, key->buf, suffix);
+    else
+        fq_write(out, buf->data, buf->len);
+    if (s->len != 0) {
+        if (fq_read(in, buf, s->len - bytes) != 0)
+            return -1;
+        fq_write(out, buf->data, buf->len);
+        return s->len;
+    }
+    for (int i = 1; i <= 3; i++) {
+        if (fq_getline(in, buf) < 0)
+            return -1;
+        bytes += buf->len;
+        fq_write(out, buf->data, buf->len);
+    }
+    return bytes;
+}
 
-    /*
-     * Read the first file and make an index of that file.
-     */
-    while (1) {
-        aline = readFromFile(is_gzip_left, lfp_gz, lfp, line, MAXLINELEN);
-        if (aline == NULL) {
-            break;  // End of file
-        }
+/*
+ * Copy the record of a static index with the ID expect to out: the one in the slot found,
+ * or, if another ID has the same key, one of the duplicates in that slot that has an ID of
+ * its own. Marks it printed. Returns the bytes we read, 0 if none of them is expect, or -1
+ * if a record isn't there any more.
+ */
+static long fetch_static_mate(struct static_index *si, uint64_t slot, const struct static_slot *found,
+                              struct fq_stream *in, const struct id_rule *rule, const char *expect,
+                              struct fq_line *buf, struct fq_line *key, struct fq_stream *out, const char *suffix,
+                              struct metrics *m) {
+    count_seek(m, in, found->pos);
+    long bytes = fetch_static(in, found, rule, expect, buf, key, out, suffix);
+    if (bytes > 0)
+        static_index_set_printed(si, slot);
+    uint64_t first = 0;
+    uint64_t n = bytes == 0 ? static_index_dups(si, slot, &first) : 0;
+    for (uint64_t d = first; d < first + n && bytes == 0; d++) {
+        const struct static_dup *dup = &si->dups[d];
+        if (dup->back != 0)
+            continue;       // a repeat of an ID we have already compared with
+        struct static_slot s = {dup->pos, dup->len, found->fp};
+        count_seek(m, in, s.pos);
+        if ((bytes = fetch_static(in, &s, rule, expect, buf, key, out, suffix)) > 0)
+            static_index_set_printed(si, si->f.nkeys + d);
+    }
+    return bytes;
+}
 
-        struct idloc *newid;
-        newid = (struct idloc *) malloc(sizeof(*newid));
+/*
+ * The records at two positions of the indexed file and the buffers to read their IDs into,
+ * for static_index_resolve
+ */
+struct id_reader {
+    struct fq_stream *in;
+    const struct id_rule *rule;
+    struct fq_line line;
+    struct fq_line a;
+    struct fq_line b;
+};
+
+static int read_key(struct id_reader *r, int64_t pos, struct fq_line *key) {
+    if (fq_seek(r->in, pos) != 0 || fq_getline(r->in, &r->line) < 0 || record_key(r->rule, &r->line, key) != 0)
+        return -1;
+    return 0;
+}
 
-        if (newid == NULL) {
-            fprintf(stderr, "Can't allocate memory for new ID pointer - first file\n");
-            return 0;
-        }
+static int same_id(void *ctx, int64_t a, int64_t b) {
+    struct id_reader *r = ctx;
+    if (read_key(r, a, &r->a) != 0 || read_key(r, b, &r->b) != 0)
+        return -1;
+    return strcmp(r->a.buf, r->b.buf) == 0;
+}
 
-        line[strcspn(line, "\n")] = '\0';
-        if (opt->splitspace)
-            line[strcspn(line, " \t")] = '\0';
-
-        /*
-         * Figure out what the match mechanism is. We have four examples so
-         *     i.   using /1 and /2
-         *     ii.  using /f and /r
-	     *     iii. using ' 1...' and ' 2....'
-         *     iii. just having the whole name
-         *
-         * If there is a /1 or /2 in the file name, we set that part to null so the string is only up
-         * to before the / and use that to store the location.
-         */
-
-        char lastchar = line[strlen(line)-1];
-        char lastbutone = line[strlen(line)-2];
-        if ('/' == lastbutone || '_' == lastbutone || '.' == lastbutone){
-            if ('1' == lastchar || '2' == lastchar || 'f' == lastchar ||  'r' == lastchar){
-                line[strlen(line)-1] = '\0'; // Add the null terminator at the new end of the string
-            }
+/*
+ * The probe works on PROBE_BATCH records at a time: it reads and hashes them all and
+ * prefetches their buckets, then prefetches the first element of each chain, and only
+ * then looks for the mates, in the order the records came. The cache misses of a batch
+ * overlap instead of each record waiting for its own.
+ */
+#define PROBE_BATCH 16
+
+#if defined(__GNUC__)
+#define PREFETCH(p) __builtin_prefetch(p)
+#else
+#define PREFETCH(p) ((void) (p))
+#endif
+
+struct probe_record {
+    struct fq_line rec;         // the four lines: a span of the input, or a copy in rec.buf
+    size_t header_len;
+    struct fq_line key;         // the ID
+    struct fq_line code;        // its code, if we code the IDs
+    const char *id;             // the ID as the hash table has it: key or code
+    size_t idlen;
+    uint64_t hashval;
+    struct idloc *chain;        // the start of its chain in the index
+    uint64_t skey;              // with --index mphf, its key
+    uint64_t slot;              // and the slot of that key
+};
+
+/*
+ * Read the next record and its ID into r. Returns 1 if there was one, 0 at the end of the
+ * file, -1 if the record is incomplete and -2 if we can't get the memory for it.
+ */
+static int read_record(struct fq_stream *in, struct fq_line *line, const struct id_rule *rule, struct probe_record *r) {
+    if (fq_getline(in, line) < 0)
+        return 0;
+    if (record_key(rule, line, &r->key) != 0)
+        return -2;
+    bool stable = fq_stable(in);
+    r->header_len = line->len;
+    r->rec.len = 0;
+    for (int i = 0; i <= 3; i++) {
+        if (i > 0 && fq_getline(in, line) < 0)
+            return -1;
+        if (stable) {
+            // the lines follow each other in the file
+            if (i == 0)
+                r->rec.data = line->data;
         } else {
-            line[strlen(line)+1] = '\0';
-            line[strlen(line)-1] = '/';
+            if (fq_line_reserve(&r->rec, r->rec.len + line->len) != 0)
+                return -2;
+            memcpy(r->rec.buf + r->rec.len, line->data, line->len);
+            r->rec.data = r->rec.buf;
         }
+        r->rec.len += line->len;
+    }
+    return 1;
+}
 
-        if (opt->verbose)
-            fprintf(stderr, "ID first file is |%s|\n", line);
+/*
+ * The buffers of a batch, for the memory accounting
+ */
+static uint64_t batch_bytes(const struct probe_record *batch) {
+    uint64_t bytes = 0;
+    for (int b = 0; b < PROBE_BATCH; b++)
+        bytes += batch[b].rec.size + batch[b].key.size + batch[b].code.size;
+    return bytes;
+}
 
-        // Hash the ID
-        unsigned hashval = hash(line) % opt->tablesize;
-
-        // Check if the ID already exists in the hash table (duplicate)
-        if (opt->deduplicate) {
-            struct idloc *existing = ids_left[hashval];
-            while (existing != NULL) {
-                if (strcmp(existing->id, line) == 0) {
-                    // ID already exists, do not add it again
-                    if (opt->verbose)
-                        fprintf(stderr, "Duplicate ID found in the first file, skipping: %s\n", line);
-                        left_duplicates_counter++;
-                    free(newid);  // Free the memory we allocated for newid
-                    newid = NULL;
-                    break;
-                }
-                existing = existing->next;
-            }
-        }
+/*
+ * Account for the line buffers as they grow to fit longer lines
+ */
+static void account_lines(struct metrics *m, uint64_t *accounted, uint64_t bytes) {
+    if (bytes > *accounted)
+        mem_account(m, MEM_IO_BUFFERS, bytes - *accounted);
+    else
+        mem_release(m, MEM_IO_BUFFERS, *accounted - bytes);
+    *accounted = bytes;
+}
+
+char *output_filename(const char *fn, const char *kind, bool is_gzip) {
+    return shard_filename(fn, kind, is_gzip, 0, 0);
+}
 
+char *shard_filename(const char *fn, const char *kind, bool is_gzip, uint32_t shard, uint32_t nshards) {
+    char *base = removeSuffix(fn);
+    if (base == NULL)
+        return NULL;
+    char part[32] = "";
+    if (nshards > 1)
+        snprintf(part, sizeof(part), ".shard%uof%u", (unsigned) shard, (unsigned) nshards);
+    size_t len = strlen(base) + strlen(kind) + strlen(part) + 16;
+    char *out = malloc(len);
+    if (out != NULL)
+        snprintf(out, len, "%s.%s%s.fastq%s", base, kind, part, is_gzip ? ".gz" : "");
+    free(base);
+    return out;
+}
 
-        if (newid != NULL) {
-            // If the ID is not a duplicate, proceed with adding it to the hash table
-            newid->id = dupstr(line);
-            newid->pos = nextposition;
-            newid->printed = false;
-            newid->next = ids_left[hashval];  // Insert at the head of the list
-            ids_left[hashval] = newid;
+/*
+ * Append the file fn to out. Unless it is NULL, *last is the last byte we wrote to out, or '\n'
+ * if none: the last record of an input file may not end with a newline, and then the next shard
+ * must not start on its quality line. (We can't see the last byte of a gzip member, so gzipped
+ * shards pass NULL.) Returns 0, or -1 if fn can't be read.
+ */
+static int append_file(FILE *out, const char *fn, char *buf, size_t size, char *last) {
+    FILE *in = fopen(fn, "rb");
+    if (in == NULL)
+        return -1;
+    size_t n;
+    bool first = true;
+    while ((n = fread(buf, 1, size, in)) > 0) {
+        if (first && last != NULL && *last != '\n')
+            fputc('\n', out);
+        first = false;
+        if (fwrite(buf, 1, n, out) != n)
+            break;
+        if (last != NULL)
+            *last = buf[n - 1];
+    }
+    int err = ferror(in) ? -1 : 0;
+    fclose(in);
+    return err;
+}
+
+int merge_shards(const char *left_fn, const char *right_fn, uint32_t nshards, struct pair_result *res) {
+    if (res != NULL)
+        memset(res, 0, sizeof(*res));
+    if (nshards < 1)
+        return pair_error(res, FQP_EINVAL, "The number of shards must be a positive number");
+    bool is_gzip = test_gzip(left_fn) || test_gzip(right_fn);
+    const char *inputs[4] = {left_fn, right_fn, left_fn, right_fn};
+    const char *kinds[4] = {"paired", "paired", "single", "single"};
+    size_t size = 1 << 20;
+    char *buf = malloc(size);
+    if (buf == NULL)
+        return pair_error(res, FQP_ENOMEM, "Can't allocate memory to copy the shards");
+    int err = FQP_OK;
+    for (int f = 0; f < 4 && err == FQP_OK; f++) {
+        char *out_fn = output_filename(inputs[f], kinds[f], is_gzip);
+        FILE *out = out_fn != NULL ? fopen(out_fn, "wb") : NULL;
+        if (out == NULL) {
+            err = out_fn == NULL ? pair_error(res, FQP_ENOMEM, "Can't allocate memory for the output file names")
+                                 : pair_error(res, FQP_EOPEN, "Can't open file %s", out_fn);
+            free(out_fn);
+            break;
+        }
+        // a gzip file can have several members one after the other, so the shards of a gzipped output just follow each other
+        char last = '\n';
+        for (uint32_t i = 0; i < nshards && err == FQP_OK; i++) {
+            char *shard_fn = shard_filename(inputs[f], kinds[f], is_gzip, i, nshards);
+            if (shard_fn == NULL)
+                err = pair_error(res, FQP_ENOMEM, "Can't allocate memory for the output file names");
+            else if (append_file(out, shard_fn, buf, size, is_gzip ? NULL : &last) != 0)
+                err = pair_error(res, FQP_EREAD, "Can't read %s", shard_fn);
+            free(shard_fn);
         }
+        if (fclose(out) != 0 && err == FQP_OK)
+            err = pair_error(res, FQP_EWRITE, "Can't write all of %s", out_fn);
+        free(out_fn);
+    }
+    free(buf);
+    return err;
+}
 
-        /* read the next three lines and ignore them: sequence, header, and quality */
-        for (int i=0; i<3; i++)
-            aline = readFromFile(is_gzip_left, lfp_gz, lfp, line, MAXLINELEN);
+/*
+ * One of the two input files, and where its records go
+ */
+struct side {
+    const char *fn;
+    const char *label;          // "first file" or "second file", for the messages
+    bool is_gzip;
+    struct fq_stream *in;
+    struct fq_stream *paired;
+    struct fq_stream *single;
+    char *paired_fn;
+    char *single_fn;
+    struct id_rule rule;
+    char mate[4];               // the mate suffix for -f
+    uint64_t records;
+    uint64_t paired_count;
+    uint64_t single_count;
+    uint64_t duplicates;
+    long int bytes;
+};
 
-        // Get the current position using tellInFile
-        nextposition = tellInFile(is_gzip_left, lfp_gz, lfp);
-    }
+/*
+ * Open the outputs for one side
+ */
+static int open_outputs(struct side *s, bool is_gzip_out, const struct options *opt, struct metrics *m, struct pair_result *res) {
+    s->paired_fn = shard_filename(s->fn, "paired", is_gzip_out, opt->shard, opt->nshards);
+    s->single_fn = shard_filename(s->fn, "single", is_gzip_out, opt->shard, opt->nshards);
+    if (s->paired_fn == NULL || s->single_fn == NULL)
+        return pair_error(res, FQP_ENOMEM, "Can't allocate memory for the output file names");
+    if ((s->paired = fq_open(s->paired_fn, "w", is_gzip_out)) == NULL)
+        return pair_error(res, FQP_EOPEN, "Can't open file %s", s->paired_fn);
+    mem_account(m, MEM_IO_BUFFERS, s->paired->buffer_bytes);
+    if ((s->single = fq_open(s->single_fn, "w", is_gzip_out)) == NULL)
+        return pair_error(res, FQP_EOPEN, "Can't open file %s", s->single_fn);
+    mem_account(m, MEM_IO_BUFFERS, s->single->buffer_bytes);
+    return FQP_OK;
+}
 
+/*
+ * Close whatever is still open on one side and free its file names. With check, a
+ * failure to close an output is an error (the outputs are only complete once they are
+ * closed) and err is returned otherwise.
+ */
+static int close_side(struct side *s, struct metrics *m, struct pair_result *res, int err, bool check) {
+    struct fq_stream **streams[3] = {&s->in, &s->paired, &s->single};
+    const char *names[3] = {s->fn, s->paired_fn, s->single_fn};
+    for (int i = 0; i < 3; i++) {
+        if (*streams[i] == NULL)
+            continue;
+        mem_release(m, MEM_IO_BUFFERS, (*streams[i])->buffer_bytes);
+        if (fq_close(*streams[i]) != 0 && check && i > 0 && err == FQP_OK)
+            err = pair_error(res, FQP_EWRITE, "Can't write all of %s", names[i]);
+        *streams[i] = NULL;
+    }
+    return err;
+}
 
+int pair_files(const char *left_fn, const char *right_fn, struct options *opt, struct pair_result *res) {
+
+    struct metrics *m = opt->metrics;
+    struct progress prog;
+    progress_init(&prog, opt->progress_interval, stderr);
+    if (opt->prom_file != NULL)
+        progress_export(&prog, opt->prom_file, opt->prom_interval, left_fn, right_fn);
+    bool mphf = opt->index == INDEX_MPHF;
+    uint64_t (*index_key)(const char *id) = opt->index_key != NULL ? opt->index_key : static_index_key;
+    prog.tablesize = mphf ? 0 : opt->tablesize;
+    uint64_t fetch_bytes = 0;
+    int err = FQP_OK;
+
+    // Everything we allocate or open, so that an error part way through can tidy up
+    struct side left, right;
+    memset(&left, 0, sizeof(left));
+    memset(&right, 0, sizeof(right));
+    left.fn = left_fn;
+    left.label = "first file";
+    right.fn = right_fn;
+    right.label = "second file";
     /*
-     * Now just print all the id lines and their positions
+     * By default we index the left file and stream the right one, so the pairs come out in
+     * the order of the right file and it is the left file we seek around in. --order left
+     * swaps them. Either way the left records go to the left outputs with the /1 suffix.
      */
+    struct side *idx = opt->order == ORDER_LEFT ? &right : &left;     // the file we index
+    struct side *str = opt->order == ORDER_LEFT ? &left : &right;     // the file we stream
+    struct idloc **ids_index = NULL;
+    struct idloc **ids_stream = NULL;   // only with -d
+    struct static_index sidx;           // instead of ids_index, with --index mphf
+    struct id_codec codec;              // how the hash tables keep the IDs
+    id_codec_init(&codec);
+    static_index_init(&sidx, opt->huge_pages);
+    uint64_t sidx_bytes = 0;
+    struct arena ids;           // every index element, from both tables
+    arena_init(&ids, 0, opt->huge_pages);
+    struct huge_usage table_pages;
+    memset(&table_pages, 0, sizeof(table_pages));
+    uint64_t thp_bytes = 0;
+    // the line buffers are all we need per record, so pairing doesn't allocate once the index is built
+    struct fq_line line;        // the line we are reading
+    struct fq_line key;         // the ID of the current record
+    struct fq_line fetch;       // the records we fetch again from the indexed file
+    struct fq_line code;        // the code of key
+    fq_line_init(&line);
+    fq_line_init(&key);
+    fq_line_init(&fetch);
+    fq_line_init(&code);
+    struct probe_record batch[PROBE_BATCH];     // the records of the streamed file we are looking up
+    for (int b = 0; b < PROBE_BATCH; b++) {
+        fq_line_init(&batch[b].rec);
+        fq_line_init(&batch[b].key);
+        fq_line_init(&batch[b].code);
+    }
+    uint64_t line_bytes = 0;
 
-    if (opt->print_table_counts) {
-        fprintf(stdout, "Bucket sizes\n");
+    if (res != NULL)
+        memset(res, 0, sizeof(*res));
+    if (opt->tablesize == 0) {
+        err = pair_error(res, FQP_EINVAL, "The table size must be a positive number");
+        goto cleanup;
+    }
+    if (opt->nshards > 1 && opt->shard >= opt->nshards) {
+        err = pair_error(res, FQP_EINVAL, "The shard must be between 0 and %u", (unsigned) opt->nshards - 1);
+        goto cleanup;
+    }
 
-        for (int i = 0; i < opt->tablesize; i++) {
-            struct idloc *ptr = ids_left[i];
-            int counter=0;
-            while (ptr != NULL) {
-                // fprintf(stdout, "ID: %s Position %ld\n", ptr->id, ptr->pos);
-                counter++;
-                ptr = ptr->next;
-            }
-            fprintf(stdout, "%d\t%d\n", i, counter);
+    // Hash table for the file we index, unless we build a static index of it once we have read it
+    if (!mphf) {
+        ids_index = alloc_table(opt->tablesize, opt->huge_pages, &table_pages);
+        if (ids_index == NULL) {
+            err = pair_error(res, FQP_ENOMEM, "We cannot allocate the memory for a table size of the %s %llu. Please try a smaller value for -t", idx->label, (unsigned long long) opt->tablesize);
+            goto cleanup;
         }
+        mem_account(m, MEM_INDEX, sizeof(*ids_index) * opt->tablesize);
+    }
+    // Only allocate memory for ids_stream if deduplication is used
+    if (opt->deduplicate) {
+        // Hash table for the file we stream
+        ids_stream = alloc_table(opt->tablesize, opt->huge_pages, &table_pages);
+        if (ids_stream == NULL) {
+            err = pair_error(res, FQP_ENOMEM, "We cannot allocate the memory for a table size of the %s %llu. Please try a smaller value for -t", str->label, (unsigned long long) opt->tablesize);
+            goto cleanup;
+        }
+        mem_account(m, MEM_INDEX, sizeof(*ids_stream) * opt->tablesize);
     }
 
-   /* now we want to open output files for left_paired, right_paired, and right_single */
-
-    FILE *left_paired, *left_single, *right_paired, *right_single;
-    gzFile left_paired_gz, left_single_gz, right_paired_gz, right_single_gz;
-
+    bool is_gzip_out = false;
 
-    char *lpfn, *rpfn, *lsfn, *rsfn;
-    if (is_gzip_out) {
-        lpfn = catstr(removeSuffix(left_fn), ".paired.fastq.gz");
-        rpfn = catstr(removeSuffix(right_fn), ".paired.fastq.gz");
-        lsfn = catstr(removeSuffix(left_fn), ".single.fastq.gz");
-        rsfn = catstr(removeSuffix(right_fn), ".single.fastq.gz");
-    } else {
-        lpfn = catstr(removeSuffix(left_fn), ".paired.fastq");
-        rpfn = catstr(removeSuffix(right_fn), ".paired.fastq");
-        lsfn = catstr(removeSuffix(left_fn), ".single.fastq");
-        rsfn = catstr(removeSuffix(right_fn), ".single.fastq");
+    phase_begin(m, PHASE_SNIFF);
+    left.is_gzip = test_gzip(left_fn);
+    right.is_gzip = test_gzip(right_fn);
+    phase_end(m, PHASE_SNIFF, 0, 0);
+    if (left.is_gzip || right.is_gzip) {
+        is_gzip_out = true;
     }
 
-    printf("Writing the paired reads to %s and %s\nWriting the single reads to %s and %s\n", lpfn, rpfn, lsfn, rsfn);
+    // we come back to the records of the indexed file, the other we read once
+    if ((idx->in = fq_open(idx->fn, "rs", idx->is_gzip)) == NULL) {
+        err = pair_error(res, FQP_EOPEN, "Can't open file %s", idx->fn);
+        goto cleanup;
+    }
+    mem_account(m, MEM_IO_BUFFERS, idx->in->buffer_bytes);
 
-    // Create output files
-    if (is_gzip_out){
-        if ((left_paired_gz = gzopen(lpfn, "wb")) == NULL) {
-                fprintf(stderr, "Can't open file %s\n", lpfn);
-                exit(1);
-        }
+    char rule_name[64];
+    detect_id_rule(idx->in, &line, opt->splitspace, &idx->rule);
+    if (opt->verbose)
+        fprintf(stderr, "IDs in the %s: %s\n", idx->label, id_rule_name(&idx->rule, rule_name, sizeof(rule_name)));
+    if (!mphf && !opt->plain_ids)
+        detect_id_codec(idx->in, &line, &idx->rule, &key, &codec);
+    if (opt->verbose && codec.enabled)
+        fprintf(stderr, "IDs are kept without their common prefix |%s| and with their numbers packed\n", codec.prefix);
 
-        if ((left_single_gz = gzopen(lsfn, "wb")) == NULL) {
-            fprintf(stderr, "Can't open file %s\n", lsfn);
-            exit(1);
-        }
+    long int nextposition = 0;
+    uint64_t index_entries = 0;
 
-        if ((right_paired_gz = gzopen(rpfn, "wb")) == NULL) {
-            fprintf(stderr, "Can't open file %s\n", rpfn);
-            exit(1);
+    /*
+     * Read the indexed file and make an index of that file.
+     */
+    phase_begin(m, PHASE_INDEX);
+    progress_phase(&prog, idx == &left ? "indexing first file" : "indexing second file", file_size(idx->fn));
+    while (fq_getline(idx->in, &line) >= 0) {
+        if (record_key(&idx->rule, &line, &key) != 0) {
+            err = pair_error(res, FQP_ENOMEM, "Can't allocate memory for an ID of %zu characters", line.len);
+            goto cleanup;
         }
 
-        if ((right_single_gz = gzopen(rsfn, "wb")) == NULL) {
-            fprintf(stderr, "Can't open file %s\n", rsfn);
-            exit(1);
-        }    
+        if (opt->verbose)
+            fprintf(stderr, "ID %s is |%s|\n", idx->label, key.buf);
 
-    } else {
-        if ((left_paired = fopen(lpfn, "w")) == NULL ) {
-            fprintf(stderr, "Can't open file %s\n", lpfn);
-            exit(1);
+        // Hash the ID
+        bool mine = in_shard(opt, key.buf);
+        uint64_t hashval = mphf ? index_key(key.buf) : hash(key.buf) % opt->tablesize;
+
+        // Check if the ID already exists in the hash table (duplicate). The static index finds them when it is built
+        struct idloc *newid = NULL;
+        size_t idlen;
+        const char *id = mphf || !mine ? key.buf : table_id(&codec, &key, &code, &idlen);
+        if (id == NULL) {
+            err = pair_error(res, FQP_ENOMEM, "Can't allocate memory for an ID of %zu characters", key.len);
+            goto cleanup;
         }
-
-        if ((left_single = fopen(lsfn, "w")) == NULL) {
-            fprintf(stderr, "Can't open file %s\n", lsfn);
-            exit(1);
+        if (mphf || !mine) {
+            // nothing to do until we know where the record ends, or at all if it is in another shard
+        } else if (opt->deduplicate && find_id(ids_index[hashval], id) != NULL) {
+            // ID already exists, do not add it again
+            if (opt->verbose)
+                fprintf(stderr, "Duplicate ID found in the %s, skipping: %s\n", idx->label, key.buf);
+            idx->duplicates++;
+        } else {
+            // If the ID is not a duplicate, proceed with adding it to the hash table
+            newid = insert_id(&ids, &ids_index[hashval], id, nextposition);
+            if (newid == NULL) {
+                err = pair_error(res, FQP_ENOMEM, "Can't allocate memory for new ID pointer - %s", idx->label);
+                goto cleanup;
+            }
+            index_entries++;
+            mem_account(m, MEM_INDEX, IDLOC_SLOT_BYTES);
+            mem_account(m, MEM_IDS, idloc_spill_bytes(newid));
         }
 
-        if ((right_paired = fopen(rpfn, "w")) == NULL) {
-            fprintf(stderr, "Can't open file %s\n", rpfn);
-            exit(1);
+        /* read the next three lines and ignore them: sequence, header, and quality */
+        for (int i=0; i<3; i++) {
+            if (fq_getline(idx->in, &line) < 0) {
+                err = pair_error(res, FQP_EFORMAT, "Record %llu in %s is incomplete", (unsigned long long) idx->records + 1, idx->fn);
+                goto cleanup;
+            }
         }
 
-        if ((right_single = fopen(rsfn, "w")) == NULL) {
-            fprintf(stderr, "Can't open file %s\n", rsfn);
-            exit(1);
-        }        
+        // Get the current position using fq_tell, and so the length of the record
+        long int recordstart = nextposition;
+        nextposition = fq_tell(idx->in);
+        if (newid != NULL && nextposition - recordstart <= (long) UINT32_MAX)
+            newid->len = (uint32_t) (nextposition - recordstart);
+        if (mphf && mine) {
+            uint32_t len = nextposition - recordstart <= (long) UINT32_MAX ? (uint32_t) (nextposition - recordstart) : 0;
+            if (static_index_add(&sidx, hashval, recordstart, len) != 0) {
+                err = pair_error(res, FQP_ENOMEM, "Can't allocate memory for the index of the %s", idx->label);
+                goto cleanup;
+            }
+        }
+        idx->records++;
+        if (progress_due(&prog, idx->records)) {
+            prog.index_entries = index_entries;
+            progress_report(&prog, idx->records, nextposition, fq_offset(idx->in));
+        }
     }
-    /*
-    * Now read the second file, and print out things in common
-    */
-
-    if (is_gzip_right){
-        if ((rfp_gz = gzopen(right_fn, "rb")) == NULL) {
-                fprintf(stderr, "Can't open file %s\n", left_fn);
-                exit(1);
+    if (mphf) {
+        if (static_index_build(&sidx, opt->threads) != 0) {
+            err = pair_error(res, FQP_ENOMEM, "Can't allocate memory for the minimal perfect hash of the %s", idx->label);
+            goto cleanup;
         }
-    } else {
-        if ((rfp = fopen(right_fn, "r")) == NULL) {
-                fprintf(stderr, "Can't open file %s\n", left_fn);
-                exit(1);
+        // a key can be shared by two IDs, so only the IDs themselves tell us which records are repeats
+        struct id_reader reader = {idx->in, &idx->rule};
+        fq_line_init(&reader.line);
+        fq_line_init(&reader.a);
+        fq_line_init(&reader.b);
+        int resolved = static_index_resolve(&sidx, opt->deduplicate, &idx->duplicates, same_id, &reader);
+        fq_line_free(&reader.line);
+        fq_line_free(&reader.a);
+        fq_line_free(&reader.b);
+        if (resolved != 0) {
+            err = pair_error(res, FQP_EREAD, "Can't read the duplicate IDs of %s again", idx->fn);
+            goto cleanup;
         }
+        // the records we collected to build it from are gone, but they were the peak
+        sidx_bytes = static_index_bytes(&sidx);
+        mem_account(m, MEM_INDEX, sidx.build_bytes);
+        mem_release(m, MEM_INDEX, sidx.build_bytes - sidx_bytes);
+        index_entries = static_index_keys(&sidx) + sidx.ndups;
     }
+    prog.index_entries = index_entries;
+    progress_done(&prog);
+    account_lines(m, &line_bytes, line.size + key.size + code.size);
+    phase_end(m, PHASE_INDEX, nextposition, idx->records);
+    idx->bytes = nextposition;
 
-    nextposition = 0;
 
-    while (1) {
-        aline = readFromFile(is_gzip_right, rfp_gz, rfp, line, MAXLINELEN);
+    /*
+     * Now report on how well the table is doing
+     */
 
-        if (aline == NULL) {
-            break;  // End of file
+    if (opt->print_table_counts || opt->dump_table) {
+        phase_begin(m, PHASE_TABLE_STATS);
+        if (opt->print_table_counts && mphf) {
+            print_static_index_stats(stdout, &sidx);
+        } else if (opt->print_table_counts) {
+            struct table_stats ts;
+            compute_table_stats(&ts, ids_index, opt->tablesize);
+            print_table_stats(stdout, &ts);
         }
+        if (opt->dump_table && !mphf)
+            dump_table(stdout, ids_index, opt->tablesize);
+        phase_end(m, PHASE_TABLE_STATS, 0, opt->tablesize);
+    }
 
-        struct idloc *newid;
-        newid = (struct idloc *) malloc(sizeof(*newid));
+   /* now we want to open the paired and single output files for both sides */
 
-        if (newid == NULL) {
-            fprintf(stderr, "Can't allocate memory for new ID pointer - second file\n");
-            return 0;
-        }
+    if ((err = open_outputs(&left, is_gzip_out, opt, m, res)) != FQP_OK ||
+        (err = open_outputs(&right, is_gzip_out, opt, m, res)) != FQP_OK)
+        goto cleanup;
 
-        // make a copy of the current line so we can print it out later.
-        char *headerline = dupstr(line);
+    /*
+    * Now read the streamed file, and print out things in common
+    */
+
+    if ((str->in = fq_open(str->fn, "r", str->is_gzip)) == NULL) {
+        err = pair_error(res, FQP_EOPEN, "Can't open file %s", str->fn);
+        goto cleanup;
+    }
+    mem_account(m, MEM_IO_BUFFERS, str->in->buffer_bytes);
+
+    detect_id_rule(str->in, &line, opt->splitspace, &str->rule);
+    if (opt->verbose)
+        fprintf(stderr, "IDs in the %s: %s\n", str->label, id_rule_name(&str->rule, rule_name, sizeof(rule_name)));
+    // the mate suffixes for -f: 1 for the first file and 2 for the second, whichever we index
+    left.mate[0] = left.rule.sep ? left.rule.sep : '/';
+    left.mate[1] = '1';
+    right.mate[0] = right.rule.sep ? right.rule.sep : '/';
+    right.mate[1] = '2';
+    left.mate[2] = right.mate[2] = '\n';
+    left.mate[3] = right.mate[3] = '\0';
 
-        line[strcspn(line, "\n")] = '\0';
-        if (opt->splitspace)
-            line[strcspn(line, " \t")] = '\0';
+    nextposition = 0;
 
-        /* remove the last character, as we did above */
-        char lastchar = line[strlen(line)-1];
-        char lastbutone = line[strlen(line)-2];
-        if ('/' == lastbutone || '_' == lastbutone || '.' == lastbutone){
-            if ('1' == lastchar || '2' == lastchar || 'f' == lastchar ||  'r' == lastchar){
-                line[strlen(line)-1] = '\0'; // Add the null terminator at the new end of the string
+    phase_begin(m, PHASE_PROBE);
+    progress_phase(&prog, str == &right ? "pairing second file" : "pairing first file", file_size(str->fn));
+    for (;;) {
+        /* read a batch of records, turning their headers into IDs as we did above, and prefetch their buckets */
+        int n = 0;
+        int status = 1;
+        while (n < PROBE_BATCH && (status = read_record(str->in, &line, &str->rule, &batch[n])) == 1) {
+            if (!in_shard(opt, batch[n].key.buf)) {
+                str->records++;
+                continue;
             }
-        } else {
-            line[strlen(line)+1] = '\0';
-            line[strlen(line)-1] = '/';
+            batch[n].hashval = hash(batch[n].key.buf) % opt->tablesize;
+            if ((batch[n].id = table_id(&codec, &batch[n].key, &batch[n].code, &batch[n].idlen)) == NULL) {
+                status = -2;
+                break;
+            }
+            if (mphf) {
+                batch[n].skey = index_key(batch[n].key.buf);
+                mphf_prefetch(&sidx.f, batch[n].skey);
+            } else {
+                PREFETCH(&ids_index[batch[n].hashval]);
+            }
+            if (opt->deduplicate)
+                PREFETCH(&ids_stream[batch[n].hashval]);
+            n++;
+        }
+        if (status < 0) {
+            if (status == -1)
+                err = pair_error(res, FQP_EFORMAT, "Record %llu in %s is incomplete", (unsigned long long) (str->records + n + 1), str->fn);
+            else
+                err = pair_error(res, FQP_ENOMEM, "Can't allocate memory for record %llu of %s", (unsigned long long) (str->records + n + 1), str->fn);
+            goto cleanup;
         }
 
-        if (opt->verbose)
-            fprintf(stderr, "ID second file is |%s|\n", line);
-
-        // Hash the ID
-        unsigned hashval = hash(line) % opt->tablesize;
-
-        // Store the current identifier outside of the line variable
-        char * entryid = dupstr(line);
-
-        // Check if the ID already exists in the hash table (duplicate)
-        if (opt->deduplicate) {
-            struct idloc *existing = ids_right[hashval];
-            while (existing != NULL) {
-                if (strcmp(existing->id, line) == 0) {
-                    // ID already exists, do not add it again
-                    if (opt->verbose)
-                        fprintf(stderr, "Duplicate ID found in the second file, skipping: %s\n", line);
-                        right_duplicates_counter++;
-                    free(newid);  // Free the memory we allocated for newid
-                    newid = NULL;
-                    break;
-                }
-                existing = existing->next;
+        /* by now the buckets are in the cache, so fetch the first element of each chain (or the slot of each key) */
+        for (int b = 0; b < n; b++) {
+            if (mphf) {
+                batch[b].slot = static_index_slot(&sidx, batch[b].skey);
+                if (batch[b].slot != MPHF_NONE)
+                    PREFETCH(&sidx.slots[batch[b].slot]);
+                continue;
             }
+            batch[b].chain = ids_index[batch[b].hashval];
+            if (batch[b].chain != NULL)
+                PREFETCH(batch[b].chain);
         }
 
-        if (newid != NULL) {
-            if (opt->deduplicate) {
-                // If the ID is not a duplicate, proceed with adding it to the hash table of the second file
-                newid->id = dupstr(line);
-                newid->pos = nextposition;
-                newid->printed = false;
-                newid->next = ids_right[hashval];  // Insert at the head of the list
-                ids_right[hashval] = newid;
-            }
-            // now see if we have the mate pair
-            unsigned hashval = hash(line) % opt->tablesize;
-            struct idloc *ptr = ids_left[hashval];
-            long int posn = -1; // -1 is not a valid file position
-            while (ptr != NULL) {
-                if (strcmp(ptr->id, line) == 0) {
-                    posn = ptr->pos;
-                    ptr->printed = true;
-                }
-                ptr = ptr->next;
+        for (int b = 0; b < n; b++) {
+            struct probe_record *r = &batch[b];
+            if (opt->verbose)
+                fprintf(stderr, "ID %s is |%s|\n", str->label, r->key.buf);
+
+            // Check if the ID already exists in the hash table (duplicate)
+            bool duplicate = false;
+            if (opt->deduplicate && find_id(ids_stream[r->hashval], r->id) != NULL) {
+                // ID already exists, do not add it again
+                if (opt->verbose)
+                    fprintf(stderr, "Duplicate ID found in the %s, skipping: %s\n", str->label, r->key.buf);
+                str->duplicates++;
+                duplicate = true;
             }
 
-            if (posn != -1) {
-                // we have a match.
-                // lets process the left file
-                seekInFile(is_gzip_left, lfp_gz, lfp, posn, SEEK_SET);
-                left_paired_counter++;
-                for (int i=0; i<=3; i++) {
-                    aline = readFromFile(is_gzip_left, lfp_gz, lfp, line, MAXLINELEN);
-                    if (i == 0 && opt->formatid) {
-                        writeToFile(is_gzip_out, left_paired_gz, left_paired, catstr(entryid, "1\n"));
-                    } else {
-                        writeToFile(is_gzip_out, left_paired_gz, left_paired, line);
+            if (!duplicate) {
+                if (opt->deduplicate) {
+                    // If the ID is not a duplicate, proceed with adding it to the hash table of the streamed file
+                    struct idloc *newid = insert_id(&ids, &ids_stream[r->hashval], r->id, nextposition);
+                    if (newid == NULL) {
+                        err = pair_error(res, FQP_ENOMEM, "Can't allocate memory for new ID pointer - %s", str->label);
+                        goto cleanup;
                     }
+                    mem_account(m, MEM_INDEX, IDLOC_SLOT_BYTES);
+                    mem_account(m, MEM_IDS, idloc_spill_bytes(newid));
                 }
-                // now process the right file
-                if (opt->formatid) {
-                    writeToFile(is_gzip_out, right_paired_gz, right_paired, catstr(entryid, "2\n"));
+                // now see if we have the mate pair
+                struct idloc *mate = NULL;
+                bool paired = false;
+                if (mphf) {
+                    // the fingerprint says it is probably there, and we check the ID as we copy the record
+                    const struct static_slot *found = static_index_find(&sidx, r->skey, r->slot);
+                    if (found != NULL) {
+                        phase_lap_begin(m, PHASE_FETCH);
+                        long bytes = fetch_static_mate(&sidx, r->slot, found, idx->in, &idx->rule, r->key.buf, &fetch, &key,
+                                                       idx->paired, opt->formatid ? idx->mate : NULL, m);
+                        if (bytes < 0) {
+                            err = pair_error(res, FQP_EREAD, "Can't read the mate of %s in %s again", r->key.buf, idx->fn);
+                            goto cleanup;
+                        }
+                        if (bytes > 0) {
+                            idx->paired_count++;
+                            paired = true;
+                        }
+                        phase_lap_end(m, PHASE_FETCH, bytes, bytes > 0);
+                    }
                 } else {
-                    writeToFile(is_gzip_out, right_paired_gz, right_paired, headerline);
+                    for (struct idloc *ptr = r->chain; ptr != NULL; ptr = ptr->next) {
+                        if (idloc_matches(ptr, r->id, r->idlen)) {
+                            mate = ptr;
+                            ptr->printed = true;
+                        }
+                    }
                 }
-                right_paired_counter++;
-                for (int i=0; i<=2; i++) {
-                    aline = readFromFile(is_gzip_right, rfp_gz, rfp, line, MAXLINELEN);
-                    writeToFile(is_gzip_out, right_paired_gz, right_paired, line);
+
+                struct fq_stream *out;
+                if (paired) {
+                    out = str->paired;
+                    str->paired_count++;
+                }
+                else if (mate != NULL) {
+                    // we have a match.
+                    // lets process the indexed file
+                    phase_lap_begin(m, PHASE_FETCH);
+                    count_seek(m, idx->in, mate->pos);
+                    idx->paired_count++;
+                    long bytes = fetch_record(idx->in, mate, r->key.buf, &fetch, idx->paired, opt->formatid ? idx->mate : NULL);
+                    if (bytes < 0) {
+                        err = pair_error(res, FQP_EREAD, "Can't read the record at position %ld of %s again", mate->pos, idx->fn);
+                        goto cleanup;
+                    }
+                    phase_lap_end(m, PHASE_FETCH, bytes, 1);
+                    // now process the streamed file
+                    out = str->paired;
+                    str->paired_count++;
+                }
+                else {
+                    out = str->single;
+                    str->single_count++;
                 }
-            }
-            else {
                 if (opt->formatid) {
-                    writeToFile(is_gzip_out, right_single_gz, right_single, catstr(entryid, "2\n"));
+                    put_formatted_id(out, r->key.buf, str->mate);
+                    fq_write(out, r->rec.data + r->header_len, r->rec.len - r->header_len);
                 } else {
-                    writeToFile(is_gzip_out, right_single_gz, right_single, headerline);
-                }
-                right_single_counter++;
-                for (int i=0; i<=2; i++) {
-                    aline = readFromFile(is_gzip_right, rfp_gz, rfp, line, MAXLINELEN);
-                    writeToFile(is_gzip_out, right_single_gz, right_single, line);
+                    fq_write(out, r->rec.data, r->rec.len);
                 }
             }
-        } else {
-            for (int i=0; i<=2; i++) {
-                aline = readFromFile(is_gzip_right, rfp_gz, rfp, line, MAXLINELEN);
-            }
+            str->records++;
+            if (progress_due(&prog, str->records))
+                progress_report(&prog, str->records, fq_tell(str->in), fq_offset(str->in));
         }
+        phase_laps_end(m, PHASE_FETCH);
+        if (n < PROBE_BATCH)
+            break;
     }
-
-    /* all that remains is to print the unprinted singles from the left file */
-
-    for (int i = 0; i < opt->tablesize; i++) {
-        struct idloc *ptr = ids_left[i];
+    progress_done(&prog);
+    account_lines(m, &line_bytes, line.size + key.size + code.size + fetch.size + batch_bytes(batch));
+    str->bytes = fq_tell(str->in);
+    phase_end(m, PHASE_PROBE, str->bytes, str->records);
+    // the index is as big as it gets, so this is when to see whether we got huge pages for it
+    if (opt->huge_pages != HUGE_PAGES_OFF)
+        thp_bytes = huge_thp_bytes();
+
+    /* all that remains is to print the unprinted singles from the indexed file */
+
+    phase_begin(m, PHASE_SINGLES);
+    // without -d a record of the indexed file is fetched again for each repeat of its ID in the streamed file, so
+    // there can be more pairs than entries
+    uint64_t unpaired = idx->paired_count < index_entries ? index_entries - idx->paired_count : 0;
+    progress_phase(&prog, idx == &left ? "writing singles from first file" : "writing singles from second file",
+                   unpaired);
+    for (uint64_t i = 0; mphf && i < static_index_keys(&sidx) + sidx.ndups; i++) {
+        // the first record with each key, then the duplicates
+        const struct static_slot *s = &sidx.slots[i];
+        struct static_slot dup;
+        uint64_t bit = i;
+        if (i >= static_index_keys(&sidx)) {
+            const struct static_dup *d = &sidx.dups[i - static_index_keys(&sidx)];
+            bit = static_index_dup_bit(&sidx, i - static_index_keys(&sidx));
+            dup.pos = d->pos;
+            dup.len = d->len;
+            s = &dup;
+        }
+        if (static_index_printed(&sidx, bit))
+            continue;
+        count_seek(m, idx->in, s->pos);
+        idx->single_count++;
+        if (progress_due(&prog, idx->single_count))
+            progress_report(&prog, idx->single_count, fetch_bytes, idx->single_count);
+        long bytes = fetch_static(idx->in, s, &idx->rule, NULL, &fetch, &key, idx->single, opt->formatid ? idx->mate : NULL);
+        if (bytes < 0) {
+            err = pair_error(res, FQP_EREAD, "Can't read the record at position %lld of %s again", (long long) s->pos, idx->fn);
+            goto cleanup;
+        }
+        fetch_bytes += bytes;
+    }
+    for (uint64_t i = 0; !mphf && i < opt->tablesize; i++) {
+        struct idloc *ptr = ids_index[i];
         while (ptr != NULL) {
             if (! ptr->printed) {
-                seekInFile(is_gzip_left, lfp_gz, lfp, ptr->pos, SEEK_SET);
-                left_single_counter++;
-                for (int n=0; n<=3; n++) {
-                    aline = readFromFile(is_gzip_left, lfp_gz, lfp, line, MAXLINELEN);
-                    if (n == 0 && opt->formatid) {
-                        writeToFile(is_gzip_out, left_single_gz, left_single, catstr(ptr->id, "1\n"));
-                    } else {
-                        writeToFile(is_gzip_out, left_single_gz, left_single, line);
-                    }
+                count_seek(m, idx->in, ptr->pos);
+                idx->single_count++;
+                if (progress_due(&prog, idx->single_count))
+                    progress_report(&prog, idx->single_count, fetch_bytes, idx->single_count);
+                const char *id = NULL;
+                if (opt->formatid && (id = element_id(&codec, ptr, &key)) == NULL) {
+                    err = pair_error(res, FQP_ENOMEM, "Can't allocate memory to decode an ID of the %s", idx->label);
+                    goto cleanup;
+                }
+                long bytes = fetch_record(idx->in, ptr, id, &fetch, idx->single, opt->formatid ? idx->mate : NULL);
+                if (bytes < 0) {
+                    err = pair_error(res, FQP_EREAD, "Can't read the record at position %ld of %s again", ptr->pos, idx->fn);
+                    goto cleanup;
                 }
+                fetch_bytes += bytes;
             }
             ptr = ptr->next;
         }
     }
-
-    fprintf(stdout, "Left paired: %-14d Right paired: %d \nLeft single: %-14d Right single: %d\n",
-            left_paired_counter, right_paired_counter, left_single_counter, right_single_counter);
-    if (opt->deduplicate) {
-        fprintf(stdout, "Left duplicates: %-10d Right duplicates: %d\n",
-                left_duplicates_counter, right_duplicates_counter);
+    progress_done(&prog);
+    account_lines(m, &line_bytes, line.size + key.size + code.size + fetch.size + batch_bytes(batch));
+    phase_end(m, PHASE_SINGLES, fetch_bytes, idx->single_count);
+
+    struct run_counters c;
+    memset(&c, 0, sizeof(c));
+    c.left_records = left.records;
+    c.right_records = right.records;
+    c.left_bytes = left.bytes;
+    c.right_bytes = right.bytes;
+    c.left_paired = left.paired_count;
+    c.right_paired = right.paired_count;
+    c.left_single = left.single_count;
+    c.right_single = right.single_count;
+    c.left_duplicates = left.duplicates;
+    c.right_duplicates = right.duplicates;
+    c.index_entries = index_entries;
+    c.is_gzip_left = left.is_gzip;
+    c.is_gzip_right = right.is_gzip;
+    c.is_gzip_out = is_gzip_out;
+    c.huge_requested = table_pages.requested + ids.usage.requested + sidx.usage.requested;
+    c.huge_hugetlb = table_pages.hugetlb + ids.usage.hugetlb + sidx.usage.hugetlb;
+    c.huge_thp = thp_bytes;
+    if (m != NULL) {
+        // the seeks were counted as we went
+        c.left_seeks = m->counters.left_seeks;
+        c.bytes_reinflated = m->counters.bytes_reinflated;
+        c.index_bytes = m->mem_live[MEM_INDEX] + m->mem_live[MEM_IDS];
+        m->counters = c;
     }
+    if (res != NULL)
+        res->counts = c;
 
-    if (is_gzip_left) {
-        gzclose(lfp_gz);
-    } else {
-        fclose(lfp);
-    }
-
-    if (is_gzip_right) {
-        gzclose(rfp_gz);
-    } else {
-        fclose(rfp);
-    }
-
-    if (is_gzip_out) {
-        gzclose(left_paired_gz);
-        gzclose(left_single_gz);
-        gzclose(right_paired_gz);
-        gzclose(right_single_gz);
-    } else {
-        fclose(left_paired);
-        fclose(left_single);
-        fclose(right_paired);
-        fclose(right_single);
-    }
+    phase_begin(m, PHASE_CLOSE);
+    err = close_side(&left, m, res, err, true);
+    err = close_side(&right, m, res, err, true);
+    phase_end(m, PHASE_CLOSE, 0, 0);
 
+cleanup:
     /*
-     * Free up the memory for all the pointers
+     * Close whatever is still open and free up the memory for all the pointers
      */
-
-
-    for (int i = 0; i < opt->tablesize; i++) {
-        struct idloc *ptr = ids_left[i];
-        struct idloc *next;
-        while (ptr != NULL) {
-            next = ptr->next;
-            free(ptr);
-            ptr=next;
-        }
+    phase_begin(m, PHASE_TEARDOWN);
+    close_side(&left, m, res, err, false);
+    close_side(&right, m, res, err, false);
+    free(left.paired_fn);
+    free(left.single_fn);
+    free(right.paired_fn);
+    free(right.single_fn);
+
+    free_table(ids_index, opt->tablesize, opt->huge_pages, m);
+    static_index_free(&sidx);
+    mem_release(m, MEM_INDEX, sidx_bytes);
+    free_table(ids_stream, opt->tablesize, opt->huge_pages, m);
+    arena_free(&ids);
+    account_lines(m, &line_bytes, 0);
+    fq_line_free(&line);
+    fq_line_free(&key);
+    fq_line_free(&fetch);
+    fq_line_free(&code);
+    for (int b = 0; b < PROBE_BATCH; b++) {
+        fq_line_free(&batch[b].rec);
+        fq_line_free(&batch[b].key);
+        fq_line_free(&batch[b].code);
     }
+    phase_end(m, PHASE_TEARDOWN, 0, 0);
+    progress_finish(&prog);
 
-    free(ids_left);
-    free(line);
-
-    if (opt->deduplicate) {
-        for (int i = 0; i < opt->tablesize; i++) {
-            struct idloc *ptr = ids_right[i];
-            struct idloc *next;
-            while (ptr != NULL) {
-                next = ptr->next;
-                free(ptr);
-                ptr=next;
-            }
-        }
-        free(ids_right);
-    }
-
-    return 0;
+    return err;
 }
 
 
-unsigned hash (char *s) {
-    unsigned hashval;
+uint64_t hash(const char *s) {
+    uint64_t hashval;
 
     for (hashval=0; *s != '\0'; s++)
         hashval = *s + 31 * hashval;
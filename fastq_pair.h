@@ -7,37 +7,62 @@
 #define CEEQLIB_INDEX_FASTQ_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "hugemem.h"
+#include "metrics.h"
 
 
 /*
- * idloc is a struct with the current file position (pos) from ftell,
- * the id string for the sequence, and whether or not we've printed it out.
- * next is a pointer to the next idloc element in the hash.
+ * options are our options that can be passed in. The most important
+ * is the table size.
  */
-struct idloc {
-    bool printed;
-    long int pos;
-    char *id;
-    struct idloc *next;
-};
 
+/*
+ * Which file's order the pairs are written in. We index one file and read the other
+ * straight through, writing the pairs as we find them, so the indexed file is the one we
+ * seek around in.
+ */
+enum output_order {
+    ORDER_RIGHT,    // index the first file, stream the second (the default)
+    ORDER_LEFT      // index the second file, stream the first
+};
 
 /*
- * options are our options that can be passed in. The most important
- * is the table size.
+ * How we index the file. The hash table is built as we read the file. The minimal perfect
+ * hash (see static_index.h) is built once we have read it, takes about a quarter of the
+ * memory, and finds an ID with fewer cache misses.
  */
+enum index_kind {
+    INDEX_HASH,     // a chained hash table of -t buckets (the default)
+    INDEX_MPHF      // a minimal perfect hash function with a fingerprint and position per ID
+};
 
 struct options {
-    int tablesize;
+    uint64_t tablesize;
+    enum output_order order;
+    enum index_kind index;
+    int threads;              // threads to build the minimal perfect hash with
+    uint64_t (*index_key)(const char *id);  // the key of an ID in the --index mphf index, NULL for the usual one
+    uint32_t shard;           // with --shard, pair only the IDs that hash to shard (from 0)
+    uint32_t nshards;         // of nshards; 0 or 1 to pair them all
+    enum huge_pages huge_pages;   // how to back the index
     bool print_table_counts;
+    bool dump_table;
     bool verbose;
     bool formatid;
     bool splitspace;
+    bool plain_ids;           // keep the IDs in the hash table as they are, not coded (see idcode.h)
     bool deduplicate;
+    double progress_interval; // seconds between progress reports, 0 for none
+    char *prom_file;          // Prometheus textfile to rewrite while we run, NULL for none
+    double prom_interval;     // seconds between rewrites of prom_file
+    struct metrics *metrics;  // per-phase timings, NULL if we are not collecting them
 };
 
-// how long should our lines be. This is a 64k buffer
-#define MAXLINELEN 65536
+#define FASTQ_PAIR_VERSION "0.4"
 
 
 
@@ -46,16 +71,104 @@ struct options {
  *
  * This is a simple hash but widely used!
  *
- * we use an unsigned here so that the answer is > 0
+ * we use a 64 bit unsigned here so that the answer is > 0 and spreads over tables
+ * with more than 2^32 buckets
  *
  * You still need to mod this on the table size
  */
 
-unsigned hash (char *s);
+uint64_t hash(const char *s);
+
+/*
+ * How the mate is marked in the headers of one file. detect it with id_rule_observe()
+ * on the first records, then normalise_id() turns each header into the ID we store.
+ */
+struct id_rule {
+    bool splitspace;    // the ID stops at the first space or tab
+    char sep;           // the IDs end with sep and mate (/1, _2, .f, ...), 0 if they don't
+    char mate;
+    bool casava;        // when not splitting, the comment starts with the mate, as in "1:N:0:ACGT"
+    int observed;       // how many headers we have looked at
+};
+
+// how many records we look at to work out the rule for a file
+#define ID_RULE_RECORDS 64
+
+void id_rule_init(struct id_rule *rule, bool splitspace);
+
+/*
+ * Look at one of the first headers of a file. A suffix (or CASAVA comment) only counts
+ * if every header has it with the same mate, so read numbers such as @SRR123.1, @SRR123.2
+ * are not mistaken for mates.
+ */
+void id_rule_observe(struct id_rule *rule, const char *line, size_t len);
+
+/*
+ * A short description of the rule, e.g. "/1 suffix", for the verbose output
+ */
+const char *id_rule_name(const struct id_rule *rule, char *buf, size_t size);
+
+/*
+ * Turn the header line (len characters, with or without the newline) into the ID that we
+ * store: strip the newline, everything from the first space or tab if we are splitting,
+ * the mate suffix, and the mate number at the start of a CASAVA comment. The ID is written
+ * to id, which needs len + 1 characters and may be line itself. Returns the length of the ID.
+ */
+size_t normalise_id(const struct id_rule *rule, const char *line, size_t len, char *id);
+
+/*
+ * What the library functions return. Use fqp_strerror() for a description.
+ */
+enum fqp_error {
+    FQP_OK = 0,
+    FQP_EINVAL,     // a bad argument or option
+    FQP_ENOMEM,     // we ran out of memory
+    FQP_EOPEN,      // a file could not be opened
+    FQP_EREAD,      // a file could not be read
+    FQP_EWRITE,     // an output file could not be written
+    FQP_EFORMAT,    // the input is not fastq, e.g. a record has fewer than four lines
+    FQP_ECALLBACK   // a callback asked us to stop
+};
+
+const char *fqp_strerror(int err);
+
+/*
+ * The outcome of pair_files: the counts, and what went wrong if it returned an error
+ */
+struct pair_result {
+    struct run_counters counts;
+    char error[256];
+};
+
+/*
+ * The name of an output file for the input fn: the name without its .fastq (or .fq) suffix,
+ * then .paired.fastq or .single.fastq (kind is "paired" or "single"), and .gz if is_gzip.
+ * The caller frees it. NULL if we are out of memory.
+ */
+char *output_filename(const char *fn, const char *kind, bool is_gzip);
+
+/*
+ * The name of an output file of shard (from 0) of nshards, e.g. left.paired.shard3of8.fastq.
+ * With nshards 0 or 1 this is output_filename().
+ */
+char *shard_filename(const char *fn, const char *kind, bool is_gzip, uint32_t shard, uint32_t nshards);
+
 /*
  * Take two fastq files (f and g), we generate paired output.
  * t is the tablesize and is the most important parameter
+ *
+ * Returns FQP_OK or one of the other fqp_error codes, with a message in res->error.
+ * Everything that was opened or allocated is released either way. res may be NULL.
+ */
+int pair_files(const char *f, const char *g, struct options *o, struct pair_result *res);
+
+/*
+ * Put together the outputs of the nshards runs of pair_files with --shard on f and g: each
+ * of the four output files is the shard files one after the other, in the order of the
+ * shards, so the paired files stay in step. Gzipped shards become the members of one gzip
+ * file. The shard files are left where they are.
+ * Returns FQP_OK or one of the other fqp_error codes, with a message in res->error.
  */
-int pair_files(char *f, char *g, struct options *o);
+int merge_shards(const char *f, const char *g, uint32_t nshards, struct pair_result *res);
 
 #endif //CEEQLIB_INDEX_FASTQ_H
@@ -0,0 +1,314 @@
+//
+// Line based I/O on fastq files through a small backend interface.
+//
+
+#include "fqio.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define FQ_LINE_MIN 1024
+
+int fq_line_reserve(struct fq_line *l, size_t size) {
+    if (size <= l->size)
+        return 0;
+    size_t n = l->size ? l->size : FQ_LINE_MIN;
+    while (n < size)
+        n *= 2;
+    char *buf = realloc(l->buf, n);
+    if (buf == NULL)
+        return -1;
+    l->buf = buf;
+    l->size = n;
+    return 0;
+}
+
+void fq_line_free(struct fq_line *l) {
+    free(l->buf);
+    fq_line_init(l);
+}
+
+/*
+ * The memory map backend, for plain files that we read through once. Lines and records
+ * are spans of the map, so nothing is copied.
+ *
+ * The pages we have read would otherwise stay in our resident set until the file is
+ * closed, so every FQ_MAP_WINDOW bytes we hand them back to the page cache. Reading them
+ * again costs a minor fault, not a disk read. A read that doesn't follow on from the last
+ * one maps the aligned 64 kB block around it (the kernel's fault-around), or two blocks
+ * if it straddles them, so we count it as FQ_MAP_JUMP bytes.
+ */
+#define FQ_MAP_WINDOW (16 << 20)
+#define FQ_MAP_ALIGN (2 << 20)
+#define FQ_MAP_JUMP (512 << 10)
+
+struct fq_map {
+    const char *data;
+    size_t size;
+    size_t pos;
+    size_t read;            // bytes handed out since we last released the pages
+    size_t lo, hi;          // the part of the map they came from
+    size_t end;             // where the last read ended
+};
+
+static void map_touched(struct fq_map *map, size_t start, size_t len) {
+    if (map->read == 0 || start < map->lo)
+        map->lo = start;
+    if (map->read == 0 || start + len > map->hi)
+        map->hi = start + len;
+    map->read += start == map->end || len > FQ_MAP_JUMP ? len : FQ_MAP_JUMP;
+    map->end = start + len;
+    if (map->read < FQ_MAP_WINDOW)
+        return;
+    // a fault maps the whole page cache folio, so release whole FQ_MAP_ALIGN blocks
+    size_t lo = map->lo & ~(size_t) (FQ_MAP_ALIGN - 1);
+    size_t hi = (map->hi + FQ_MAP_ALIGN - 1) & ~(size_t) (FQ_MAP_ALIGN - 1);
+    if (hi > map->size)
+        hi = map->size;
+    madvise((void *) (map->data + lo), hi - lo, MADV_DONTNEED);
+    map->read = 0;
+}
+
+static ssize_t mmap_getline(struct fq_stream *s, struct fq_line *l) {
+    struct fq_map *map = s->handle;
+    if (map->pos >= map->size)
+        return -1;
+    const char *start = map->data + map->pos;
+    const char *nl = memchr(start, '\n', map->size - map->pos);
+    size_t len = nl != NULL ? (size_t) (nl - start) + 1 : map->size - map->pos;
+    l->data = start;
+    l->len = len;
+    map_touched(map, map->pos, len);
+    map->pos += len;
+    return (ssize_t) len;
+}
+
+static int mmap_read(struct fq_stream *s, struct fq_line *l, size_t len) {
+    struct fq_map *map = s->handle;
+    if (map->pos > map->size || len > map->size - map->pos)
+        return -1;
+    l->data = map->data + map->pos;
+    l->len = len;
+    map_touched(map, map->pos, len);
+    map->pos += len;
+    return 0;
+}
+
+static int mmap_write(struct fq_stream *s, const char *data, size_t len) {
+    (void) s;
+    (void) data;
+    (void) len;
+    return -1;
+}
+
+static int mmap_seek(struct fq_stream *s, long offset) {
+    struct fq_map *map = s->handle;
+    if (offset < 0 || (size_t) offset > map->size)
+        return -1;
+    map->pos = offset;
+    return 0;
+}
+
+static long mmap_tell(struct fq_stream *s) {
+    return (long) ((struct fq_map *) s->handle)->pos;
+}
+
+static int mmap_close(struct fq_stream *s) {
+    struct fq_map *map = s->handle;
+    int ret = munmap((void *) map->data, map->size);
+    free(map);
+    return ret;
+}
+
+const struct fq_backend fq_mmap_backend = {
+        "mmap", false, true, mmap_getline, mmap_read, mmap_write, mmap_seek, mmap_tell, mmap_tell, mmap_close
+};
+
+/*
+ * Map a regular, non-empty file. NULL if it isn't one or it can't be mapped, and then
+ * we read it through stdio instead.
+ */
+static struct fq_map *map_file(const char *fn) {
+    int fd = open(fn, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    struct fq_map *map = NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && (uint64_t) st.st_size <= SIZE_MAX) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            map = malloc(sizeof(*map));
+            if (map != NULL) {
+                map->data = data;
+                map->size = st.st_size;
+                map->pos = 0;
+                map->read = 0;
+                map->end = 0;
+            } else {
+                munmap(data, st.st_size);
+            }
+        }
+    }
+    close(fd);
+    return map;
+}
+
+/*
+ * The plain backend is stdio with its BUFSIZ buffer. It is what we use for the files we
+ * seek around in: a jump into a map faults in a whole page cache folio, which costs far
+ * more than refilling the buffer.
+ */
+static ssize_t plain_getline(struct fq_stream *s, struct fq_line *l) {
+    ssize_t len = getline(&l->buf, &l->size, s->handle);
+    if (len < 0)
+        return -1;
+    l->data = l->buf;
+    l->len = len;
+    return len;
+}
+
+static int plain_read(struct fq_stream *s, struct fq_line *l, size_t len) {
+    if (fq_line_reserve(l, len) != 0 || fread(l->buf, 1, len, s->handle) != len)
+        return -1;
+    l->data = l->buf;
+    l->len = len;
+    return 0;
+}
+
+static int plain_write(struct fq_stream *s, const char *data, size_t len) {
+    return fwrite(data, 1, len, s->handle) == len ? 0 : -1;
+}
+
+static int plain_seek(struct fq_stream *s, long offset) {
+    return fseek(s->handle, offset, SEEK_SET);
+}
+
+static long plain_tell(struct fq_stream *s) {
+    return ftell(s->handle);
+}
+
+static int plain_close(struct fq_stream *s) {
+    return fclose(s->handle);
+}
+
+const struct fq_backend fq_plain_backend = {
+        "plain", false, false, plain_getline, plain_read, plain_write, plain_seek, plain_tell, plain_tell, plain_close
+};
+
+/*
+ * The gzip backend. gzseek() cannot jump: it inflates forward from where it is, or
+ * rewinds to the start of the file and inflates from there.
+ */
+static ssize_t gzip_getline(struct fq_stream *s, struct fq_line *l) {
+    size_t len = 0;
+    for (;;) {
+        // gzgets takes an int, so a line longer than that is read in pieces
+        if (fq_line_reserve(l, len + 2) != 0)
+            return -1;
+        size_t room = l->size - len;
+        if (room > INT_MAX)
+            room = INT_MAX;
+        if (gzgets(s->handle, l->buf + len, (int) room) == NULL)
+            break;
+        len += strlen(l->buf + len);
+        if (l->buf[len - 1] == '\n')
+            break;
+    }
+    if (len == 0)
+        return -1;
+    l->data = l->buf;
+    l->len = len;
+    return (ssize_t) len;
+}
+
+static int gzip_read(struct fq_stream *s, struct fq_line *l, size_t len) {
+    if (fq_line_reserve(l, len) != 0)
+        return -1;
+    for (size_t done = 0; done < len;) {
+        unsigned chunk = len - done > INT_MAX ? INT_MAX : (unsigned) (len - done);
+        int n = gzread(s->handle, l->buf + done, chunk);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    l->data = l->buf;
+    l->len = len;
+    return 0;
+}
+
+static int gzip_write(struct fq_stream *s, const char *data, size_t len) {
+    for (size_t done = 0; done < len;) {
+        unsigned chunk = len - done > INT_MAX ? INT_MAX : (unsigned) (len - done);
+        if (gzwrite(s->handle, data + done, chunk) <= 0)
+            return -1;
+        done += chunk;
+    }
+    return 0;
+}
+
+static int gzip_seek(struct fq_stream *s, long offset) {
+    return gzseek(s->handle, offset, SEEK_SET) == -1 ? -1 : 0;
+}
+
+static long gzip_tell(struct fq_stream *s) {
+    return gztell(s->handle);
+}
+
+static long gzip_offset(struct fq_stream *s) {
+    return gzoffset(s->handle);
+}
+
+static int gzip_close(struct fq_stream *s) {
+    return gzclose(s->handle) == Z_OK ? 0 : -1;
+}
+
+const struct fq_backend fq_gzip_backend = {
+        "gzip", true, false, gzip_getline, gzip_read, gzip_write, gzip_seek, gzip_tell, gzip_offset, gzip_close
+};
+
+/*
+ * zlib allocates an input buffer and an output buffer of twice that (8 kB each by default)
+ * plus the inflate state and its 32 kB window when reading, and about 256 kB of deflate
+ * state when writing.
+ */
+static uint64_t gzip_buffer_bytes(bool writing) {
+    if (writing)
+        return 3 * 8192 + (1 << 17) + (1 << 17) + 6 * (1 << 14);
+    return 3 * 8192 + (1 << 15) + 7 * 1024;
+}
+
+struct fq_stream *fq_open(const char *fn, const char *mode, bool is_gzip) {
+    struct fq_stream *s = malloc(sizeof(*s));
+    if (s == NULL)
+        return NULL;
+    bool writing = mode[0] == 'w';
+    if (is_gzip) {
+        s->be = &fq_gzip_backend;
+        s->handle = gzopen(fn, writing ? "wb" : "rb");
+        s->buffer_bytes = gzip_buffer_bytes(writing);
+    } else if (!writing && mode[1] != 's' && (s->handle = map_file(fn)) != NULL) {
+        // the map is the page cache, so there is no buffer of our own
+        s->be = &fq_mmap_backend;
+        s->buffer_bytes = 0;
+    } else {
+        s->be = &fq_plain_backend;
+        s->handle = fopen(fn, writing ? "w" : "r");
+        s->buffer_bytes = BUFSIZ;
+    }
+    if (s->handle == NULL) {
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+int fq_close(struct fq_stream *s) {
+    int ret = s->be->close(s);
+    free(s);
+    return ret;
+}
@@ -0,0 +1,145 @@
+//
+// Line based I/O on fastq files through a small backend interface.
+//
+// Each stream picks its backend (a memory map, plain stdio or gzip) once, when it is
+// opened, and the loops in pair_files() then call through the stream's function table.
+// That keeps the "is this file gzipped?" question out of the per-line code, and a new
+// backend (BGZF, spilling to a temporary file) only has to fill in another struct fq_backend.
+//
+// There is no limit on the length of a line: long reads can be megabases. The memory map
+// hands out spans of the file without copying them, and the other backends read into a
+// buffer that doubles whenever a line doesn't fit.
+//
+
+#ifndef FASTQ_PAIR_FQIO_H
+#define FASTQ_PAIR_FQIO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+struct fq_stream;
+
+/*
+ * A line or a record that we read. data points either into the stream's memory map or into
+ * buf, which grows to fit the longest line we have seen. data is only valid until the next
+ * read from the same stream, and it is not NUL terminated.
+ */
+struct fq_line {
+    const char *data;
+    size_t len;
+    char *buf;
+    size_t size;
+};
+
+struct fq_backend {
+    const char *name;
+    bool compressed;        // positions from tell() are in the uncompressed data
+    bool stable;            // lines are consecutive spans of the file, valid until it is closed
+    ssize_t (*getline)(struct fq_stream *s, struct fq_line *l);
+    int (*read)(struct fq_stream *s, struct fq_line *l, size_t len);
+    int (*write)(struct fq_stream *s, const char *data, size_t len);
+    int (*seek)(struct fq_stream *s, long offset);
+    long (*tell)(struct fq_stream *s);
+    long (*offset)(struct fq_stream *s);
+    int (*close)(struct fq_stream *s);
+};
+
+struct fq_stream {
+    const struct fq_backend *be;
+    void *handle;           // the FILE *, gzFile or memory map
+    uint64_t buffer_bytes;  // how much buffer memory the backend holds for this stream
+};
+
+extern const struct fq_backend fq_mmap_backend;
+extern const struct fq_backend fq_plain_backend;
+extern const struct fq_backend fq_gzip_backend;
+
+/*
+ * Open fn for reading (mode "r"), reading with a lot of seeks (mode "rs") or writing
+ * (mode "w") with the gzip or the plain backend. A plain regular file opened with "r" is
+ * mapped into memory if it can be. Returns NULL if the file can't be opened.
+ */
+struct fq_stream *fq_open(const char *fn, const char *mode, bool is_gzip);
+
+/*
+ * Close the stream and free it. Returns 0 on success.
+ */
+int fq_close(struct fq_stream *s);
+
+static inline void fq_line_init(struct fq_line *l) {
+    l->data = NULL;
+    l->len = 0;
+    l->buf = NULL;
+    l->size = 0;
+}
+
+/*
+ * Make sure buf has at least size bytes, doubling it as often as needed. Returns 0 on success.
+ */
+int fq_line_reserve(struct fq_line *l, size_t size);
+
+void fq_line_free(struct fq_line *l);
+
+/*
+ * Read the next line, including its newline. Returns its length, or -1 at the end of
+ * the file (or if we ran out of memory for a long line).
+ */
+static inline ssize_t fq_getline(struct fq_stream *s, struct fq_line *l) {
+    return s->be->getline(s, l);
+}
+
+/*
+ * Read exactly len bytes. Returns 0 on success and -1 if the file ends first.
+ */
+static inline int fq_read(struct fq_stream *s, struct fq_line *l, size_t len) {
+    return s->be->read(s, l, len);
+}
+
+/*
+ * Write len bytes. Returns 0 on success.
+ */
+static inline int fq_write(struct fq_stream *s, const char *data, size_t len) {
+    return s->be->write(s, data, len);
+}
+
+static inline int fq_puts(struct fq_stream *s, const char *line) {
+    return fq_write(s, line, strlen(line));
+}
+
+/*
+ * Move to offset, a position that fq_tell returned. Returns 0 on success.
+ */
+static inline int fq_seek(struct fq_stream *s, long offset) {
+    return s->be->seek(s, offset);
+}
+
+/*
+ * The position in the (uncompressed) data
+ */
+static inline long fq_tell(struct fq_stream *s) {
+    return s->be->tell(s);
+}
+
+/*
+ * The position in the file on disk: the compressed offset for a gzip file
+ */
+static inline long fq_offset(struct fq_stream *s) {
+    return s->be->offset(s);
+}
+
+static inline bool fq_compressed(const struct fq_stream *s) {
+    return s->be->compressed;
+}
+
+/*
+ * Whether the lines we read stay where they are until the stream is closed, so that a
+ * caller can hold on to several records without copying them
+ */
+static inline bool fq_stable(const struct fq_stream *s) {
+    return s->be->stable;
+}
+
+#endif //FASTQ_PAIR_FQIO_H
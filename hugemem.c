@@ -0,0 +1,105 @@
+//
+// Memory for the index, backed by 2 MB pages where we can get them.
+//
+
+#include "hugemem.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+
+static bool use_calloc(size_t size, enum huge_pages mode) {
+    return mode == HUGE_PAGES_OFF || size < HUGE_PAGE_SIZE;
+}
+
+static size_t huge_round(size_t size) {
+    return (size + HUGE_PAGE_SIZE - 1) & ~(size_t) (HUGE_PAGE_SIZE - 1);
+}
+
+/*
+ * Anonymous memory aligned to HUGE_PAGE_SIZE, which the kernel needs before it will use a
+ * huge page. We map one page too many and unmap the ends.
+ */
+static void *map_aligned(size_t len) {
+    char *raw = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+        return NULL;
+    char *p = (char *) (((uintptr_t) raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+    if (p > raw)
+        munmap(raw, p - raw);
+    munmap(p + len, raw + HUGE_PAGE_SIZE - p);
+    return p;
+}
+
+void *huge_alloc(size_t size, enum huge_pages mode, struct huge_usage *u) {
+    if (use_calloc(size, mode))
+        return calloc(1, size);
+    size_t len = huge_round(size);
+    if (len < size)
+        return NULL;
+    if (u != NULL)
+        u->requested += len;
+    if (mode == HUGE_PAGES_HUGETLB) {
+        void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+        if (p != MAP_FAILED) {
+            if (u != NULL)
+                u->hugetlb += len;
+            return p;
+        }
+        if (u != NULL)
+            u->fallbacks++;
+    }
+    void *p = map_aligned(len);
+    if (p == NULL)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    madvise(p, len, MADV_HUGEPAGE);
+#endif
+    return p;
+}
+
+void huge_free(void *p, size_t size, enum huge_pages mode) {
+    if (p == NULL)
+        return;
+    if (use_calloc(size, mode))
+        free(p);
+    else
+        munmap(p, huge_round(size));
+}
+
+uint64_t huge_thp_bytes(void) {
+    FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+    if (fp == NULL)
+        return 0;
+    char buf[256];
+    unsigned long long kb = 0;
+    while (fgets(buf, sizeof(buf), fp) != NULL)
+        if (sscanf(buf, "AnonHugePages: %llu", &kb) == 1)
+            break;
+    fclose(fp);
+    return (uint64_t) kb * 1024;
+}
+
+static const char *huge_names[] = {"off", "thp", "hugetlb"};
+
+const char *huge_pages_name(enum huge_pages mode) {
+    return huge_names[mode];
+}
+
+int huge_pages_parse(const char *name, enum huge_pages *mode) {
+    for (int i = 0; i < (int) (sizeof(huge_names) / sizeof(huge_names[0])); i++) {
+        if (strcmp(name, huge_names[i]) == 0) {
+            *mode = (enum huge_pages) i;
+            return 0;
+        }
+    }
+    return -1;
+}
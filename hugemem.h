@@ -0,0 +1,62 @@
+//
+// Memory for the index, backed by 2 MB pages where we can get them.
+//
+// A lookup in a table of several GB lands on a different 4 kB page almost every time, so
+// nearly every probe is a TLB miss as well as a cache miss. With 2 MB pages the TLB covers
+// 512 times as much of the table. We ask for transparent huge pages with madvise(), or for
+// pages from the hugetlb pool (which the administrator has to reserve) and fall back to
+// transparent huge pages if there are none. Small allocations are not worth a page of their
+// own and come from calloc().
+//
+
+#ifndef FASTQ_PAIR_HUGEMEM_H
+#define FASTQ_PAIR_HUGEMEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HUGE_PAGE_SIZE (2 << 20)
+
+enum huge_pages {
+    HUGE_PAGES_OFF,         // plain calloc()
+    HUGE_PAGES_THP,         // transparent huge pages, if the kernel has them (the default)
+    HUGE_PAGES_HUGETLB      // the hugetlb pool, or transparent huge pages when it is empty
+};
+
+/*
+ * What we asked for and what we got, added up over all the allocations
+ */
+struct huge_usage {
+    uint64_t requested;     // bytes we wanted backed by huge pages
+    uint64_t hugetlb;       // bytes we got from the hugetlb pool
+    uint64_t fallbacks;     // MAP_HUGETLB allocations that fell back to transparent huge pages
+};
+
+/*
+ * size bytes of zeroed memory, aligned to HUGE_PAGE_SIZE if it is at least that big. u
+ * may be NULL. Returns NULL if there is no memory.
+ */
+void *huge_alloc(size_t size, enum huge_pages mode, struct huge_usage *u);
+
+/*
+ * Free memory from huge_alloc, with the same size and mode
+ */
+void huge_free(void *p, size_t size, enum huge_pages mode);
+
+/*
+ * The transparent huge pages this process has now (AnonHugePages), in bytes. Whether
+ * madvise() got us any is up to the kernel, so this is how we find out. 0 if we can't tell.
+ */
+uint64_t huge_thp_bytes(void);
+
+/*
+ * "off", "thp" or "hugetlb"
+ */
+const char *huge_pages_name(enum huge_pages mode);
+
+/*
+ * Parse a name from huge_pages_name. Returns 0 on success.
+ */
+int huge_pages_parse(const char *name, enum huge_pages *mode);
+
+#endif //FASTQ_PAIR_HUGEMEM_H
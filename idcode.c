@@ -0,0 +1,143 @@
+//
+// A compact form of the IDs we keep in the index.
+//
+// A code is a flag, ID_WITH_PREFIX or ID_WITHOUT_PREFIX, then the rest of the ID:
+//     - a run of digits that does not start with 0 (up to 19 of them) is a number. Its
+//       first byte has the top bit set, the number's low 6 bits, and 0x40 if more bytes
+//       follow; they hold 7 bits each, low bits first, with the top bit set on all but the last
+//     - a byte of 0x80 or more, or ID_ESCAPE, is ID_ESCAPE and the byte
+//     - anything else, including a 0 that starts a run of digits, is itself
+//
+
+#include "idcode.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ID_WITH_PREFIX 1
+#define ID_WITHOUT_PREFIX 2
+#define ID_ESCAPE 3
+#define ID_NUMBER_DIGITS 19     // the most digits that always fit in 64 bits
+
+void id_codec_init(struct id_codec *c) {
+    c->enabled = false;
+    c->prefix_len = 0;
+    c->prefix[0] = '\0';
+}
+
+static inline bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static inline bool is_alnum(char c) {
+    return is_digit(c) || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+size_t id_encode(const struct id_codec *c, const char *id, size_t len, char *out) {
+    unsigned char *o = (unsigned char *) out;
+    size_t i = 0;
+    if (len >= c->prefix_len && memcmp(id, c->prefix, c->prefix_len) == 0) {
+        *o++ = ID_WITH_PREFIX;
+        i = c->prefix_len;
+    } else {
+        *o++ = ID_WITHOUT_PREFIX;
+    }
+    while (i < len) {
+        unsigned char b = (unsigned char) id[i];
+        if (b >= '1' && b <= '9') {
+            uint64_t v = 0;
+            for (int d = 0; d < ID_NUMBER_DIGITS && i < len && is_digit(id[i]); d++)
+                v = 10 * v + (uint64_t) (id[i++] - '0');
+            *o++ = (unsigned char) (0x80 | (v & 0x3f) | (v >= 64 ? 0x40 : 0));
+            for (v >>= 6; v != 0; v >>= 7)
+                *o++ = (unsigned char) ((v & 0x7f) | (v >= 128 ? 0x80 : 0));
+            continue;
+        }
+        if (b >= 0x80 || b == ID_ESCAPE)
+            *o++ = ID_ESCAPE;
+        *o++ = b;
+        i++;
+    }
+    *o = '\0';
+    return (size_t) (o - (unsigned char *) out);
+}
+
+size_t id_decode(const struct id_codec *c, const char *code, char *out) {
+    const unsigned char *p = (const unsigned char *) code;
+    char *o = out;
+    if (*p++ == ID_WITH_PREFIX) {
+        memcpy(o, c->prefix, c->prefix_len);
+        o += c->prefix_len;
+    }
+    while (*p != '\0') {
+        unsigned char b = *p++;
+        if (b == ID_ESCAPE) {
+            *o++ = (char) *p++;
+        } else if (b < 0x80) {
+            *o++ = (char) b;
+        } else {
+            uint64_t v = b & 0x3f;
+            if (b & 0x40) {
+                int shift = 6;
+                do {
+                    b = *p++;
+                    v |= (uint64_t) (b & 0x7f) << shift;
+                    shift += 7;
+                } while (b & 0x80);
+            }
+            char digits[ID_NUMBER_DIGITS + 1];
+            int n = 0;
+            do {
+                digits[n++] = (char) ('0' + v % 10);
+                v /= 10;
+            } while (v != 0);
+            while (n > 0)
+                *o++ = digits[--n];
+        }
+    }
+    *o = '\0';
+    return (size_t) (o - out);
+}
+
+void id_codec_train(struct id_codec *c, const char *ids, int n) {
+    id_codec_init(c);
+    if (n == 0)
+        return;
+
+    // the longest prefix that all the IDs share, cut back to just after a separator so that
+    // it doesn't take the first digits of a number with it
+    size_t lcp = strlen(ids);
+    size_t longest = lcp;
+    const char *id = ids;
+    for (int k = 1; k < n; k++) {
+        id += strlen(id) + 1;
+        size_t i = 0;
+        while (i < lcp && id[i] == ids[i])
+            i++;
+        lcp = i;
+        if (strlen(id) > longest)
+            longest = strlen(id);
+    }
+    while (lcp > 0 && is_alnum(ids[lcp - 1]))
+        lcp--;
+    if (lcp >= ID_PREFIX_MAX)
+        lcp = 0;
+    memcpy(c->prefix, ids, lcp);
+    c->prefix[lcp] = '\0';
+    c->prefix_len = lcp;
+
+    // is it worth it?
+    char *code = malloc(2 * longest + 2);
+    if (code == NULL)
+        return;
+    size_t raw = 0, coded = 0;
+    id = ids;
+    for (int k = 0; k < n; k++) {
+        size_t len = strlen(id);
+        raw += len + 1;
+        coded += id_encode(c, id, len, code) + 1;
+        id += len + 1;
+    }
+    free(code);
+    c->enabled = 4 * coded <= 3 * raw;
+}
@@ -0,0 +1,59 @@
+//
+// A compact form of the IDs we keep in the index.
+//
+// The IDs in a file share a long prefix (@A00123:456:HXXXXDSXY: for an Illumina run,
+// @SRR1234567. for SRA) followed by a few numbers. We work out the prefix from the first
+// records of the indexed file, and code each ID as a byte saying whether it starts with the
+// prefix, then the rest of the ID with every run of digits as a variable length number:
+// 2:1101:8919:1000 takes 10 bytes. The coding is the same for every ID, so two IDs are the
+// same if and only if their codes are, and we compare the codes without decoding them.
+// A code never contains a NUL, so it is a string like any other ID.
+//
+// If the sample does not get at least a quarter smaller we store the IDs as they are.
+//
+
+#ifndef FASTQ_PAIR_IDCODE_H
+#define FASTQ_PAIR_IDCODE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ID_PREFIX_MAX 256
+
+struct id_codec {
+    bool enabled;
+    size_t prefix_len;
+    char prefix[ID_PREFIX_MAX];
+};
+
+/*
+ * A codec that stores the IDs as they are
+ */
+void id_codec_init(struct id_codec *c);
+
+/*
+ * Choose the prefix from n sample IDs, stored one after the other with a NUL after each,
+ * and decide whether coding them is worth it
+ */
+void id_codec_train(struct id_codec *c, const char *ids, int n);
+
+/*
+ * Code the ID (len characters) into out, which needs 2 * len + 2 bytes, and add a NUL. Returns
+ * the length of the code. Only call this if the codec is enabled.
+ */
+size_t id_encode(const struct id_codec *c, const char *id, size_t len, char *out);
+
+/*
+ * The most characters the ID with a code of len bytes can have
+ */
+static inline size_t id_decoded_max(const struct id_codec *c, size_t len) {
+    return c->prefix_len + 3 * len;
+}
+
+/*
+ * Turn a code back into the ID in out, which needs id_decoded_max() + 1 bytes, with a NUL.
+ * Returns the length of the ID.
+ */
+size_t id_decode(const struct id_codec *c, const char *code, char *out);
+
+#endif //FASTQ_PAIR_IDCODE_H
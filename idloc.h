@@ -0,0 +1,71 @@
+//
+// The elements of the hash table index. They are internal to fastq_pair and the library,
+// so this header is not installed.
+//
+
+#ifndef FASTQ_PAIR_IDLOC_H
+#define FASTQ_PAIR_IDLOC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "arena.h"
+
+/*
+ * idloc is a struct with the current file position (pos) from ftell,
+ * the id string for the sequence, and whether or not we've printed it out.
+ * len is the length of the whole record, so we can fetch it again in one read (0 if
+ * it is too long to fit, and then we read it line by line).
+ * next is a pointer to the next idloc element in the hash.
+ *
+ * The ID is stored in the element, with its length (idlen) so that a comparison can skip
+ * IDs of the wrong length without looking at them. Every element is a slot of
+ * IDLOC_SLOT_BYTES with room for an ID of up to IDLOC_INLINE - 1 characters, which takes
+ * in most SRA IDs (SRR1234567.123456 is 17) and most IDs once pair_files has coded them
+ * (see idcode.h), so comparing one touches no memory outside the slot. A longer ID spills
+ * past the end of the slot into the arena.
+ */
+struct idloc {
+    struct idloc *next;
+    long int pos;
+    uint32_t len;
+    uint32_t idlen;
+    bool printed;
+    char id[];
+};
+
+#define IDLOC_INLINE 23
+#define IDLOC_SLOT_BYTES (offsetof(struct idloc, id) + IDLOC_INLINE)
+
+static inline bool idloc_inline(const struct idloc *p) {
+    return p->idlen < IDLOC_INLINE;
+}
+
+/*
+ * The bytes the ID of an element takes up past the end of its slot, 0 if it is inline
+ */
+static inline size_t idloc_spill_bytes(const struct idloc *p) {
+    return idloc_inline(p) ? 0 : p->idlen + 1 - IDLOC_INLINE;
+}
+
+/*
+ * Whether the ID of an element is id, which is len characters long
+ */
+static inline bool idloc_matches(const struct idloc *p, const char *id, size_t len) {
+    return p->idlen == len && memcmp(p->id, id, len) == 0;
+}
+
+/*
+ * Return the first element in the chain starting at ptr with this id, or NULL
+ */
+struct idloc *find_id(struct idloc *ptr, const char *id);
+
+/*
+ * Add a copy of id with its file position to the front of the chain in bucket. The element
+ * and its id come from the arena, and are freed with it.
+ * Returns the new element, or NULL if we could not allocate it.
+ */
+struct idloc *insert_id(struct arena *a, struct idloc **bucket, const char *id, long int pos);
+
+#endif //FASTQ_PAIR_IDLOC_H
@@ -7,13 +7,16 @@
 #include <stdbool.h>
 #include "is_gzipped.h"
 
-bool test_gzip(char* filename) {
+bool test_gzip(const char *filename) {
     FILE *fileptr;
     char buffer[2];
 
     fileptr = fopen(filename, "rb");
-    fread(buffer, 2, 1, fileptr);
-    if ((buffer[0] == '\x1F') && (buffer[1] == '\x8B'))
+    if (fileptr == NULL)
+        return false;
+    size_t n = fread(buffer, 2, 1, fileptr);
+    fclose(fileptr);
+    if (n == 1 && (buffer[0] == '\x1F') && (buffer[1] == '\x8B'))
         return true;
 
     return false;
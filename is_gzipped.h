@@ -7,6 +7,9 @@
 
 #include <stdbool.h>
 
-bool test_gzip(char *filename);
+/*
+ * Does the file start with the gzip magic number? false if it can't be read
+ */
+bool test_gzip(const char *filename);
 
 #endif //FASTQ_PAIR_IS_GZIPPED_H
@@ -0,0 +1,334 @@
+//
+// libfastqpair: pair fastq records in memory, without writing and re-reading files.
+//
+
+#include "libfastqpair.h"
+#include "idloc.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct fqp_context {
+    struct fqp_config cfg;
+    struct fqp_callbacks cb;
+    void *user;
+    struct idloc **ids_left;
+    struct idloc **ids_right;   // only with deduplicate
+    struct arena ids;           // the elements of both tables
+    struct fqp_record *records; // the left records, idloc->pos is the index in here
+    size_t nrecords;
+    size_t records_size;
+    struct id_rule rules[2];    // how each side marks its mates, from its first ID_RULE_RECORDS records
+    struct fqp_record held[2][ID_RULE_RECORDS]; // copies of the records of a side until its rule is known
+    size_t nheld[2];
+    bool settled[2];            // the rule of the side is known and its held records have been added
+    char *scratch;              // the ID being normalised
+    size_t scratch_size;
+    bool probing;               // we have seen a right record
+    bool finished;
+    struct run_counters counts;
+    char error[256];
+};
+
+static const char *error_names[] = {
+        "success",
+        "invalid argument",
+        "out of memory",
+        "can't open file",
+        "can't read file",
+        "can't write file",
+        "not a fastq file",
+        "stopped by a callback",
+};
+
+const char *fqp_strerror(int err) {
+    if (err < 0 || err >= (int) (sizeof(error_names) / sizeof(error_names[0])))
+        return "unknown error";
+    return error_names[err];
+}
+
+static int context_error(struct fqp_context *ctx, int err, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(ctx->error, sizeof(ctx->error), fmt, ap);
+    va_end(ap);
+    return err;
+}
+
+void fqp_config_init(struct fqp_config *cfg) {
+    cfg->tablesize = 100003;
+    cfg->deduplicate = false;
+    cfg->splitspace = true;
+    cfg->huge_pages = HUGE_PAGES_THP;
+}
+
+int fqp_new(struct fqp_context **ctx, const struct fqp_config *cfg, const struct fqp_callbacks *cb, void *user) {
+    *ctx = NULL;
+    if (cfg->tablesize == 0)
+        return FQP_EINVAL;
+    struct fqp_context *c = calloc(1, sizeof(*c));
+    if (c == NULL)
+        return FQP_ENOMEM;
+    c->cfg = *cfg;
+    if (cb != NULL)
+        c->cb = *cb;
+    c->user = user;
+    arena_init(&c->ids, 0, cfg->huge_pages);
+    id_rule_init(&c->rules[FQP_LEFT], cfg->splitspace);
+    id_rule_init(&c->rules[FQP_RIGHT], cfg->splitspace);
+    if (cfg->tablesize <= SIZE_MAX / sizeof(*c->ids_left)) {
+        c->ids_left = huge_alloc(cfg->tablesize * sizeof(*c->ids_left), cfg->huge_pages, NULL);
+        if (cfg->deduplicate)
+            c->ids_right = huge_alloc(cfg->tablesize * sizeof(*c->ids_right), cfg->huge_pages, NULL);
+    }
+    if (c->ids_left == NULL || (cfg->deduplicate && c->ids_right == NULL)) {
+        fqp_free(c);
+        return FQP_ENOMEM;
+    }
+    *ctx = c;
+    return FQP_OK;
+}
+
+/*
+ * Whether rec is a record we can pair
+ */
+static int check_record(struct fqp_context *ctx, const struct fqp_record *rec) {
+    if (rec == NULL || rec->header == NULL || rec->seq == NULL || rec->plus == NULL || rec->qual == NULL)
+        return context_error(ctx, FQP_EINVAL, "A record needs all four lines");
+    if (strlen(rec->header) < 2 || rec->header[0] != '@')
+        return context_error(ctx, FQP_EFORMAT, "%s is not a fastq header", rec->header);
+    return FQP_OK;
+}
+
+/*
+ * Turn the header into the ID we store, in the scratch buffer
+ */
+static int record_id(struct fqp_context *ctx, enum fqp_side side, const struct fqp_record *rec, char **id) {
+    size_t len = strlen(rec->header);
+    if (len + 1 > ctx->scratch_size) {
+        char *s = realloc(ctx->scratch, len + 1);
+        if (s == NULL)
+            return context_error(ctx, FQP_ENOMEM, "Can't allocate memory for an ID");
+        ctx->scratch = s;
+        ctx->scratch_size = len + 1;
+    }
+    normalise_id(&ctx->rules[side], rec->header, len, ctx->scratch);
+    *id = ctx->scratch;
+    return FQP_OK;
+}
+
+/*
+ * Copy the four lines of rec into one allocation. Returns FQP_ENOMEM if we can't.
+ */
+static int copy_record(const struct fqp_record *rec, struct fqp_record *copy) {
+    const char *lines[4] = {rec->header, rec->seq, rec->plus, rec->qual};
+    size_t lens[4], total = 0;
+    for (int i = 0; i < 4; i++)
+        total += lens[i] = strlen(lines[i]) + 1;
+    char *data = malloc(total);
+    if (data == NULL)
+        return FQP_ENOMEM;
+    const char *copies[4];
+    for (int i = 0; i < 4; i++) {
+        memcpy(data, lines[i], lens[i]);
+        copies[i] = data;
+        data += lens[i];
+    }
+    copy->header = copies[0];
+    copy->seq = copies[1];
+    copy->plus = copies[2];
+    copy->qual = copies[3];
+    return FQP_OK;
+}
+
+/*
+ * Keep a copy of a left record, all four lines in one allocation
+ */
+static int store_record(struct fqp_context *ctx, const struct fqp_record *rec) {
+    if (ctx->nrecords == ctx->records_size) {
+        size_t size = ctx->records_size ? 2 * ctx->records_size : 1024;
+        struct fqp_record *r = realloc(ctx->records, size * sizeof(*r));
+        if (r == NULL)
+            return FQP_ENOMEM;
+        ctx->records = r;
+        ctx->records_size = size;
+    }
+    if (copy_record(rec, &ctx->records[ctx->nrecords]) != FQP_OK)
+        return FQP_ENOMEM;
+    ctx->nrecords++;
+    return FQP_OK;
+}
+
+static int callback_result(struct fqp_context *ctx, int ret) {
+    if (ret != 0)
+        return context_error(ctx, FQP_ECALLBACK, "A callback returned %d", ret);
+    return FQP_OK;
+}
+
+static int index_left(struct fqp_context *ctx, const struct fqp_record *rec) {
+    char *id;
+    int err = record_id(ctx, FQP_LEFT, rec, &id);
+    if (err != FQP_OK)
+        return err;
+    ctx->counts.left_records++;
+
+    uint64_t hashval = hash(id) % ctx->cfg.tablesize;
+    if (ctx->cfg.deduplicate && find_id(ctx->ids_left[hashval], id) != NULL) {
+        ctx->counts.left_duplicates++;
+        if (ctx->cb.duplicate != NULL)
+            return callback_result(ctx, ctx->cb.duplicate(ctx->user, FQP_LEFT, rec));
+        return FQP_OK;
+    }
+    if (store_record(ctx, rec) != FQP_OK)
+        return context_error(ctx, FQP_ENOMEM, "Can't allocate memory for a left record");
+    if (insert_id(&ctx->ids, &ctx->ids_left[hashval], id, (long) ctx->nrecords - 1) == NULL)
+        return context_error(ctx, FQP_ENOMEM, "Can't allocate memory for new ID pointer - first file");
+    ctx->counts.index_entries++;
+    return FQP_OK;
+}
+
+static int probe_right(struct fqp_context *ctx, const struct fqp_record *rec) {
+    char *id;
+    int err = record_id(ctx, FQP_RIGHT, rec, &id);
+    if (err != FQP_OK)
+        return err;
+    ctx->counts.right_records++;
+
+    uint64_t hashval = hash(id) % ctx->cfg.tablesize;
+    if (ctx->cfg.deduplicate) {
+        if (find_id(ctx->ids_right[hashval], id) != NULL) {
+            ctx->counts.right_duplicates++;
+            if (ctx->cb.duplicate != NULL)
+                return callback_result(ctx, ctx->cb.duplicate(ctx->user, FQP_RIGHT, rec));
+            return FQP_OK;
+        }
+        if (insert_id(&ctx->ids, &ctx->ids_right[hashval], id, (long) ctx->counts.right_records - 1) == NULL)
+            return context_error(ctx, FQP_ENOMEM, "Can't allocate memory for new ID pointer - second file");
+    }
+
+    // as in pair_files, every match is marked as printed and the last one is the mate
+    long posn = -1;
+    size_t len = strlen(id);
+    for (struct idloc *ptr = ctx->ids_left[hashval]; ptr != NULL; ptr = ptr->next) {
+        if (idloc_matches(ptr, id, len)) {
+            posn = ptr->pos;
+            ptr->printed = true;
+        }
+    }
+    if (posn != -1) {
+        ctx->counts.left_paired++;
+        ctx->counts.right_paired++;
+        if (ctx->cb.pair != NULL)
+            return callback_result(ctx, ctx->cb.pair(ctx->user, &ctx->records[posn], rec));
+    } else {
+        ctx->counts.right_single++;
+        if (ctx->cb.single != NULL)
+            return callback_result(ctx, ctx->cb.single(ctx->user, FQP_RIGHT, rec));
+    }
+    return FQP_OK;
+}
+
+static void free_held(struct fqp_context *ctx, enum fqp_side side) {
+    for (size_t i = 0; i < ctx->nheld[side]; i++)
+        free((char *) ctx->held[side][i].header);
+    ctx->nheld[side] = 0;
+}
+
+/*
+ * The rule of a side is fixed: add the records we held back while we worked it out
+ */
+static int settle(struct fqp_context *ctx, enum fqp_side side) {
+    if (ctx->settled[side])
+        return FQP_OK;
+    ctx->settled[side] = true;
+    int err = FQP_OK;
+    for (size_t i = 0; err == FQP_OK && i < ctx->nheld[side]; i++)
+        err = side == FQP_LEFT ? index_left(ctx, &ctx->held[side][i]) : probe_right(ctx, &ctx->held[side][i]);
+    free_held(ctx, side);
+    return err;
+}
+
+/*
+ * Like pair_files, we work out the rule of a side from its first ID_RULE_RECORDS records,
+ * so we hold on to those until we have seen them all (or the side ends)
+ */
+static int add_record(struct fqp_context *ctx, enum fqp_side side, const struct fqp_record *rec) {
+    int err = check_record(ctx, rec);
+    if (err != FQP_OK)
+        return err;
+    if (ctx->settled[side])
+        return side == FQP_LEFT ? index_left(ctx, rec) : probe_right(ctx, rec);
+    if (copy_record(rec, &ctx->held[side][ctx->nheld[side]]) != FQP_OK)
+        return context_error(ctx, FQP_ENOMEM, "Can't allocate memory for a record");
+    ctx->nheld[side]++;
+    id_rule_observe(&ctx->rules[side], rec->header, strlen(rec->header));
+    if (ctx->rules[side].observed == ID_RULE_RECORDS)
+        return settle(ctx, side);
+    return FQP_OK;
+}
+
+int fqp_add_left(struct fqp_context *ctx, const struct fqp_record *rec) {
+    if (ctx->probing || ctx->finished)
+        return context_error(ctx, FQP_EINVAL, "All the left records have to be added before the right ones");
+    return add_record(ctx, FQP_LEFT, rec);
+}
+
+int fqp_add_right(struct fqp_context *ctx, const struct fqp_record *rec) {
+    if (ctx->finished)
+        return context_error(ctx, FQP_EINVAL, "fqp_finish has already been called");
+    if (!ctx->probing) {
+        ctx->probing = true;
+        int err = settle(ctx, FQP_LEFT);
+        if (err != FQP_OK)
+            return err;
+    }
+    return add_record(ctx, FQP_RIGHT, rec);
+}
+
+int fqp_finish(struct fqp_context *ctx) {
+    if (ctx->finished)
+        return context_error(ctx, FQP_EINVAL, "fqp_finish has already been called");
+    ctx->finished = true;
+    int err = settle(ctx, FQP_LEFT);
+    if (err == FQP_OK)
+        err = settle(ctx, FQP_RIGHT);
+    if (err != FQP_OK)
+        return err;
+    for (uint64_t i = 0; i < ctx->cfg.tablesize; i++) {
+        for (struct idloc *ptr = ctx->ids_left[i]; ptr != NULL; ptr = ptr->next) {
+            if (ptr->printed)
+                continue;
+            ctx->counts.left_single++;
+            if (ctx->cb.single != NULL) {
+                int ret = ctx->cb.single(ctx->user, FQP_LEFT, &ctx->records[ptr->pos]);
+                if (ret != 0)
+                    return callback_result(ctx, ret);
+            }
+        }
+    }
+    return FQP_OK;
+}
+
+const struct run_counters *fqp_counts(const struct fqp_context *ctx) {
+    return &ctx->counts;
+}
+
+const char *fqp_error_message(const struct fqp_context *ctx) {
+    return ctx->error;
+}
+
+void fqp_free(struct fqp_context *ctx) {
+    if (ctx == NULL)
+        return;
+    huge_free(ctx->ids_left, ctx->cfg.tablesize * sizeof(*ctx->ids_left), ctx->cfg.huge_pages);
+    huge_free(ctx->ids_right, ctx->cfg.tablesize * sizeof(*ctx->ids_right), ctx->cfg.huge_pages);
+    arena_free(&ctx->ids);
+    free_held(ctx, FQP_LEFT);
+    free_held(ctx, FQP_RIGHT);
+    for (size_t i = 0; i < ctx->nrecords; i++)
+        free((char *) ctx->records[i].header);
+    free(ctx->records);
+    free(ctx->scratch);
+    free(ctx);
+}
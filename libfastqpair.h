@@ -0,0 +1,109 @@
+//
+// libfastqpair: pair fastq records in memory, without writing and re-reading files.
+//
+// A context holds the index of the left records. Add every left record with
+// fqp_add_left(), then stream the right records through fqp_add_right(): each one is
+// reported as soon as we know whether it has a mate, through the pair or the single
+// callback. fqp_finish() reports the left records that were never paired, in the same
+// order fastq_pair writes them. Contexts share nothing, so separate contexts can be used
+// from separate threads.
+//
+// Like fastq_pair, we work out how each side marks its mates (/1, .2, a CASAVA comment, ...)
+// from its first ID_RULE_RECORDS records. Until we have them, or the side ends, its records
+// are held back, so the callbacks for the first records of a side can come a little later.
+//
+// To pair files on disk use pair_files() from fastq_pair.h, which is also in the library.
+//
+
+#ifndef FASTQ_PAIR_LIBFASTQPAIR_H
+#define FASTQ_PAIR_LIBFASTQPAIR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "fastq_pair.h"
+
+enum fqp_side {
+    FQP_LEFT,
+    FQP_RIGHT
+};
+
+/*
+ * One fastq record. The strings don't need to end with a newline. The library copies
+ * what it keeps, so the caller can reuse the memory when the call returns.
+ */
+struct fqp_record {
+    const char *header;     // the @ line
+    const char *seq;
+    const char *plus;       // the + line
+    const char *qual;
+};
+
+/*
+ * The callbacks return 0 to carry on, or anything else to stop: the call that made the
+ * callback then returns FQP_ECALLBACK. Any of them can be NULL. The records are only
+ * valid during the callback.
+ */
+struct fqp_callbacks {
+    int (*pair)(void *user, const struct fqp_record *left, const struct fqp_record *right);
+    int (*single)(void *user, enum fqp_side side, const struct fqp_record *rec);
+    int (*duplicate)(void *user, enum fqp_side side, const struct fqp_record *rec);  // only with deduplicate
+};
+
+struct fqp_config {
+    uint64_t tablesize;     // as for -t, about the number of left records
+    bool deduplicate;       // as for -d, report repeated IDs to the duplicate callback and otherwise ignore them
+    bool splitspace;        // the ID stops at the first space or tab
+    enum huge_pages huge_pages; // how to back the index, as for --huge-pages
+};
+
+struct fqp_context;
+
+/*
+ * The defaults that fastq_pair uses
+ */
+void fqp_config_init(struct fqp_config *cfg);
+
+/*
+ * Make a new context in *ctx. user is passed to every callback.
+ */
+int fqp_new(struct fqp_context **ctx, const struct fqp_config *cfg, const struct fqp_callbacks *cb, void *user);
+
+/*
+ * Index a left record. All the left records have to be added before the first right one.
+ */
+int fqp_add_left(struct fqp_context *ctx, const struct fqp_record *rec);
+
+/*
+ * Look for the mate of a right record, and report the pair or the single
+ */
+int fqp_add_right(struct fqp_context *ctx, const struct fqp_record *rec);
+
+/*
+ * Report the left records that were not paired. The context can't be used after this,
+ * except to read the counts.
+ */
+int fqp_finish(struct fqp_context *ctx);
+
+/*
+ * The records, pairs, singles and duplicates so far
+ */
+const struct run_counters *fqp_counts(const struct fqp_context *ctx);
+
+/*
+ * What went wrong in the last call that returned an error
+ */
+const char *fqp_error_message(const struct fqp_context *ctx);
+
+void fqp_free(struct fqp_context *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //FASTQ_PAIR_LIBFASTQPAIR_H
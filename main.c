@@ -1,4 +1,8 @@
 #include "fastq_pair.h"
+#include "multiversion.h"
+#include "is_gzipped.h"
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -14,15 +18,88 @@ long long get_time_ms()
     return milliseconds;
 }
 
+/*
+ * The -t value, or 0 (which pair_files rejects) if it is not a positive number that fits
+ * in 64 bits. atoi() used to wrap large values round to negative table sizes.
+ */
+static uint64_t parse_tablesize(const char *s) {
+    char *end;
+    errno = 0;
+    unsigned long long t = strtoull(s, &end, 10);
+    if (*s == '-' || end == s || *end != '\0' || errno != 0)
+        return 0;
+    return t;
+}
+
+/*
+ * The --shard value, i/N with i < N, into *shard and *nshards. Returns 0, or -1 if it is not one.
+ */
+static int parse_shard(const char *s, uint32_t *shard, uint32_t *nshards) {
+    unsigned i, n;
+    char extra;
+    if (sscanf(s, "%u/%u%c", &i, &n, &extra) != 2 || n == 0 || i >= n)
+        return -1;
+    *shard = i;
+    *nshards = n;
+    return 0;
+}
+
+/*
+ * The --threads value into *threads. Returns 0, or -1 if it is not a whole number of at least 1.
+ */
+static int parse_threads(const char *s, int *threads) {
+    char *end;
+    errno = 0;
+    long t = strtol(s, &end, 10);
+    if (end == s || *end != '\0' || errno != 0 || t < 1 || t > INT_MAX)
+        return -1;
+    *threads = (int) t;
+    return 0;
+}
+
+/*
+ * A number of seconds into *seconds. Returns 0, or -1 if it is not a number, is negative,
+ * or is 0 and zero_ok is false.
+ */
+static int parse_seconds(const char *s, bool zero_ok, double *seconds) {
+    char *end;
+    errno = 0;
+    double t = strtod(s, &end);
+    if (end == s || *end != '\0' || errno != 0 || !(t >= 0) || (t == 0 && !zero_ok))
+        return -1;
+    *seconds = t;
+    return 0;
+}
 
 void help(char *s);
 
+/*
+ * fastq_pair merge N file1 file2: put the outputs of the N --shard runs together
+ */
+static int merge_main(int argc, char *argv[]) {
+    char *end;
+    unsigned long n = argc == 5 ? strtoul(argv[2], &end, 10) : 0;
+    if (argc != 5 || *argv[2] == '-' || end == argv[2] || *end != '\0' || n == 0 || n > UINT32_MAX) {
+        fprintf(stderr, "\n\nERROR: use %s merge N [fastq file 1] [fastq file 2]\n", argv[0]);
+        return 1;
+    }
+    struct pair_result res;
+    int err = merge_shards(argv[3], argv[4], (uint32_t) n, &res);
+    if (err != FQP_OK) {
+        fprintf(stderr, "ERROR: %s (%s)\n", res.error, fqp_strerror(err));
+        return 1;
+    }
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
 
     if (argc == 2 && (strcmp(argv[1], "-V") == 0)) {
-        fprintf(stdout, "%s version %0.1f\n", argv[0], 0.3);
+        fprintf(stdout, "%s version %s\n", argv[0], FASTQ_PAIR_VERSION);
         exit(0);
     }
+    if (argc > 1 && strcmp(argv[1], "merge") == 0)
+        return merge_main(argc, argv);
     if (argc < 3) {
         help(argv[0]);
         exit(0);
@@ -30,13 +107,34 @@ int main(int argc, char* argv[]) {
 
     struct options *opt;
     opt = malloc(sizeof(struct options));
+    if (opt == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate memory for the options\n");
+        return 1;
+    }
 
     opt->deduplicate = false;
     opt->formatid = false;
     opt->splitspace = true;
+    opt->plain_ids = false;
     opt->tablesize = 100003;
+    opt->order = ORDER_RIGHT;
+    opt->index = INDEX_HASH;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    opt->threads = cpus > 0 ? (int) cpus : 1;
+    opt->huge_pages = HUGE_PAGES_THP;
+    opt->index_key = NULL;
+    opt->shard = 0;
+    opt->nshards = 0;
     opt->print_table_counts = false;
+    opt->dump_table = false;
     opt->verbose = false;
+    opt->metrics = NULL;
+    opt->progress_interval = 0;
+    opt->prom_file = NULL;
+    opt->prom_interval = 15;
+    char *metrics_file = NULL;
+    bool perf_counters = false;
+    bool report = false;        // the phase and memory reports, which -v also prints
     char *left_file = NULL;
     char *right_file = NULL;
 
@@ -44,18 +142,90 @@ int main(int argc, char* argv[]) {
     // we use this to parse the file name and see if it is a valid file.
 
     for (int i=1; i<argc; i++) {
-        if (strcmp(argv[i], "-t") == 0)
-            opt->tablesize = atoi(argv[++i]);
+        if (strcmp(argv[i], "-t") == 0 && i+1 < argc)
+            opt->tablesize = parse_tablesize(argv[++i]);
+        else if (strcmp(argv[i], "--order") == 0 && i+1 < argc) {
+            i++;
+            if (strcmp(argv[i], "left") == 0)
+                opt->order = ORDER_LEFT;
+            else if (strcmp(argv[i], "right") == 0)
+                opt->order = ORDER_RIGHT;
+            else {
+                fprintf(stderr, "\n\nERROR: --order must be left or right, not %s\n", argv[i]);
+                help(argv[0]);
+                exit(-1);
+            }
+        }
+        else if (strcmp(argv[i], "--index") == 0 && i+1 < argc) {
+            i++;
+            if (strcmp(argv[i], "hash") == 0)
+                opt->index = INDEX_HASH;
+            else if (strcmp(argv[i], "mphf") == 0)
+                opt->index = INDEX_MPHF;
+            else {
+                fprintf(stderr, "\n\nERROR: --index must be hash or mphf, not %s\n", argv[i]);
+                help(argv[0]);
+                exit(-1);
+            }
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i+1 < argc) {
+            if (parse_threads(argv[++i], &opt->threads) != 0) {
+                fprintf(stderr, "\n\nERROR: --threads must be a whole number of at least 1, not %s\n", argv[i]);
+                help(argv[0]);
+                exit(-1);
+            }
+        }
+        else if (strcmp(argv[i], "--huge-pages") == 0 && i+1 < argc) {
+            if (huge_pages_parse(argv[++i], &opt->huge_pages) != 0) {
+                fprintf(stderr, "\n\nERROR: --huge-pages must be off, thp or hugetlb, not %s\n", argv[i]);
+                help(argv[0]);
+                exit(-1);
+            }
+        }
+        else if (strcmp(argv[i], "--shard") == 0 && i+1 < argc) {
+            if (parse_shard(argv[++i], &opt->shard, &opt->nshards) != 0) {
+                // an array job with the wrong task index must not pair the whole files and succeed
+                fprintf(stderr, "\n\nERROR: --shard must be i/N with i from 0 to N-1, not %s\n", argv[i]);
+                help(argv[0]);
+                exit(-1);
+            }
+        }
         else if (strcmp(argv[i], "-p") == 0)
             opt->print_table_counts = true;
+        else if (strcmp(argv[i], "--dump-table") == 0)
+            opt->dump_table = true;
         else if (strcmp(argv[i], "-d") == 0)
             opt->deduplicate = true;
         else if (strcmp(argv[i], "-f") == 0)
             opt->formatid = true;
         else if (strcmp(argv[i], "-s") == 0)
-            opt->verbose = false;
+            opt->splitspace = false;
+        else if (strcmp(argv[i], "--plain-ids") == 0)
+            opt->plain_ids = true;
         else if (strcmp(argv[i], "-v") == 0)
             opt->verbose = true;
+        else if (strcmp(argv[i], "--progress") == 0 && i+1 < argc) {
+            if (parse_seconds(argv[++i], true, &opt->progress_interval) != 0) {
+                fprintf(stderr, "\n\nERROR: --progress must be a number of seconds (0 for no reports), not %s\n", argv[i]);
+                help(argv[0]);
+                exit(-1);
+            }
+        }
+        else if (strcmp(argv[i], "--prom-file") == 0 && i+1 < argc)
+            opt->prom_file = argv[++i];
+        else if (strcmp(argv[i], "--prom-interval") == 0 && i+1 < argc) {
+            if (parse_seconds(argv[++i], false, &opt->prom_interval) != 0) {
+                fprintf(stderr, "\n\nERROR: --prom-interval must be a number of seconds above 0, not %s\n", argv[i]);
+                help(argv[0]);
+                exit(-1);
+            }
+        }
+        else if (strcmp(argv[i], "--report") == 0)
+            report = true;
+        else if (strcmp(argv[i], "--perf-counters") == 0)
+            perf_counters = true;
+        else if (strcmp(argv[i], "--metrics") == 0 && i+1 < argc)
+            metrics_file = argv[++i];
         else if (access(argv[i], F_OK) != -1 && left_file == NULL)
             left_file = argv[i];
         else if (access(argv[i], F_OK) != -1 && right_file == NULL)
@@ -75,24 +245,107 @@ int main(int argc, char* argv[]) {
     end_time = get_time_ms();
     overhead_time = end_time - start_time;
 
+    if (opt->verbose)
+        report = true;
+    if (report || metrics_file != NULL || perf_counters) {
+        opt->metrics = calloc(1, sizeof(struct metrics));
+        if (opt->metrics == NULL) {
+            fprintf(stderr, "ERROR: Can't allocate memory for the metrics\n");
+            free(opt);
+            return 1;
+        }
+    }
+    if (perf_counters)
+        perf_counters_open(&opt->metrics->perf);
+
+    bool is_gzip_left = test_gzip(left_file);
+    bool is_gzip_right = test_gzip(right_file);
+    bool is_gzip_out = is_gzip_left || is_gzip_right;
+    fprintf(stderr, "First file is gzipped: %s\n", is_gzip_left ? "true" : "false");
+    fprintf(stderr, "Second file is gzipped: %s\n", is_gzip_right ? "true" : "false");
+    fprintf(stderr, "Output files will be gzipped: %s\n", is_gzip_out ? "true" : "false");
+
+    if (opt->nshards > 1)
+        fprintf(stderr, "Pairing shard %u of %u (from 0)\n", (unsigned) opt->shard, (unsigned) opt->nshards);
+
+    char *lpfn = shard_filename(left_file, "paired", is_gzip_out, opt->shard, opt->nshards);
+    char *rpfn = shard_filename(right_file, "paired", is_gzip_out, opt->shard, opt->nshards);
+    char *lsfn = shard_filename(left_file, "single", is_gzip_out, opt->shard, opt->nshards);
+    char *rsfn = shard_filename(right_file, "single", is_gzip_out, opt->shard, opt->nshards);
+    if (lpfn != NULL && rpfn != NULL && lsfn != NULL && rsfn != NULL)
+        printf("Writing the paired reads to %s and %s\nWriting the single reads to %s and %s\n", lpfn, rpfn, lsfn, rsfn);
+    free(lpfn);
+    free(rpfn);
+    free(lsfn);
+    free(rsfn);
+
+    struct pair_result res;
     start_time = get_time_ms();
-    int success = pair_files(left_file, right_file, opt);
+    int err = pair_files(left_file, right_file, opt, &res);
     end_time = get_time_ms();
-    if (opt->verbose)
+    if (err != FQP_OK) {
+        fprintf(stderr, "ERROR: %s (%s)\n", res.error, fqp_strerror(err));
+        free(opt->metrics);
+        free(opt);
+        return 1;
+    }
+
+    struct run_counters *c = &res.counts;
+    fprintf(stdout, "Left paired: %-14llu Right paired: %llu \nLeft single: %-14llu Right single: %llu\n",
+            (unsigned long long) c->left_paired, (unsigned long long) c->right_paired,
+            (unsigned long long) c->left_single, (unsigned long long) c->right_single);
+    if (opt->deduplicate) {
+        fprintf(stdout, "Left duplicates: %-10llu Right duplicates: %llu\n",
+                (unsigned long long) c->left_duplicates, (unsigned long long) c->right_duplicates);
+    }
+
+    if (opt->huge_pages == HUGE_PAGES_HUGETLB && c->huge_hugetlb < c->huge_requested)
+        fprintf(stderr, "Only %llu of %llu bytes of the index came from the hugetlb pool, the rest used transparent huge pages\n",
+                (unsigned long long) c->huge_hugetlb, (unsigned long long) c->huge_requested);
+
+    int success = 0;
+    if (report) {
         printf ("Elapsed time = %lld (ms)\n", end_time - start_time - overhead_time);
+        printf ("Kernel level = %s\n", kernel_level());
+        print_phase_report(stdout, opt->metrics);
+        print_memory_report(stdout, opt->metrics);
+    }
+    if (perf_counters)
+        print_hw_report(stdout, opt->metrics);
+    if (metrics_file != NULL && write_metrics_json(metrics_file, opt->metrics, opt, left_file, right_file,
+                                                   end_time - start_time - overhead_time) != 0)
+        success = 1;
+    if (perf_counters)
+        perf_counters_close(&opt->metrics->perf);
+    free(opt->metrics);
+    free(opt);
 
     return success;
 }
 
 void help(char *s) {
     fprintf(stdout, "\n%s [options] [fastq file 1] [fastq file 2]\n", s);
+    fprintf(stdout, "%s merge N [fastq file 1] [fastq file 2]\n", s);
     fprintf(stdout, "\nOPTIONS\n");
     fprintf(stdout, "-f reformat sequence identifiers to minimal identifiers in both files (should not be used with -s option)\n");
     fprintf(stdout, "-s do not split sequence IDs on spaces. See issue #14 for more details (should not be used with -f option)\n");
     fprintf(stdout, "-d remove duplicate sequences (based on the identifiers). Note that this will double the amount of memory required\n");
     fprintf(stdout, "-t table size (default 100003)\n");
-    fprintf(stdout, "-p print the number of elements in each bucket in the table\n");
-    fprintf(stdout, "-v verbose output. This is mainly for debugging\n");
+    fprintf(stdout, "--plain-ids keep the IDs in the hash table as they are, instead of without their common prefix and with their numbers packed. This uses more memory and is mainly for debugging\n");
+    fprintf(stdout, "--order left|right write the pairs in the order of the first (left) or second (right, the default) file. The other file is indexed and read back with seeks, so make it the smaller or the uncompressed one\n");
+    fprintf(stdout, "--index hash|mphf index the first file with a hash table of -t buckets (hash, the default) or, in about a quarter of the memory, with a minimal perfect hash function built once the file has been read (mphf)\n");
+    fprintf(stdout, "--threads N build the minimal perfect hash with N threads (default: the number of CPUs)\n");
+    fprintf(stdout, "--huge-pages off|thp|hugetlb back the index with 2 MB pages: transparent huge pages (thp, the default) or the hugetlb pool, falling back to thp if it is empty\n");
+    fprintf(stdout, "--shard i/N pair only the reads whose IDs hash to shard i (0 to N-1) and write them to .shardiofN. files, so that N jobs can share the files. Put the shards together with merge N and the same two files\n");
+    fprintf(stdout, "-p print hash table statistics (load factor, chain lengths, memory per entry and a suggested table size)\n");
+    fprintf(stdout, "--dump-table print the number of elements in each bucket in the table (debugging only, one line per bucket)\n");
+    fprintf(stdout, "-v verbose output: every ID of both files and the --report. This is mainly for debugging, and it slows fastq_pair down\n");
+    fprintf(stdout, "--report print a per-phase timing and throughput report and a memory report at the end\n");
+    fprintf(stdout, "--progress N report the records and bytes processed, the rate and the time remaining to stderr every N seconds\n");
+    fprintf(stdout, "--prom-file FILE rewrite FILE, a Prometheus textfile with the current rates, index occupancy and memory, while we run\n");
+    fprintf(stdout, "--prom-interval N rewrite the --prom-file every N seconds (default 15)\n");
+    fprintf(stdout, "--perf-counters count cycles, instructions, cache, branch and TLB misses for each phase (Linux only)\n");
+    fprintf(stdout, "--metrics FILE write all counters, phase timings and the configuration to FILE as JSON\n");
     fprintf(stdout, "-V print the current version number and exit\n");
 }
 
@@ -0,0 +1,282 @@
+//
+// Per-phase timing and throughput accounting for pair_files().
+//
+
+#include "metrics.h"
+#include "fastq_pair.h"
+#include "multiversion.h"
+#include <sys/resource.h>
+
+static const char *phase_names[PHASE_COUNT] = {
+        "input sniffing",
+        "index build",
+        "table stats",
+        "probe",
+        "fetch I/O",
+        "singles sweep",
+        "output close/flush",
+        "teardown",
+};
+
+static const char *mem_names[MEM_COUNT] = {
+        "index",
+        "id strings",
+        "I/O buffers",
+};
+
+static double elapsed_ms(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000.0 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+const char *phase_name(enum phase_id p) {
+    return phase_names[p];
+}
+
+void phase_begin(struct metrics *m, enum phase_id p) {
+    if (m == NULL)
+        return;
+    if (m->perf.available)
+        perf_counters_read(&m->perf, m->phase[p].hw_start);
+    clock_gettime(CLOCK_MONOTONIC, &m->phase[p].wall_start);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &m->phase[p].cpu_start);
+}
+
+void phase_end(struct metrics *m, enum phase_id p, uint64_t bytes, uint64_t records) {
+    if (m == NULL)
+        return;
+    struct timespec wall_end, cpu_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+    if (m->perf.available) {
+        uint64_t hw_end[HW_COUNT];
+        perf_counters_read(&m->perf, hw_end);
+        for (int c = 0; c < HW_COUNT; c++)
+            m->phase[p].hw[c] += hw_end[c] - m->phase[p].hw_start[c];
+    }
+    m->phase[p].wall_ms += elapsed_ms(&m->phase[p].wall_start, &wall_end);
+    m->phase[p].cpu_ms += elapsed_ms(&m->phase[p].cpu_start, &cpu_end);
+    m->phase[p].bytes += bytes;
+    m->phase[p].records += records;
+    read_rss_kb(&m->phase[p].rss_kb, &m->phase[p].peak_rss_kb);
+}
+
+void phase_lap_begin(struct metrics *m, enum phase_id p) {
+    if (m == NULL)
+        return;
+    struct phase_stats *ps = &m->phase[p];
+    clock_gettime(CLOCK_MONOTONIC, &ps->lap_start);
+    if (!ps->in_laps) {
+        ps->in_laps = true;
+        ps->wall_start = ps->lap_start;
+        if (m->perf.available)
+            perf_counters_read(&m->perf, ps->hw_start);
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ps->cpu_start);
+    }
+}
+
+void phase_lap_end(struct metrics *m, enum phase_id p, uint64_t bytes, uint64_t records) {
+    if (m == NULL)
+        return;
+    struct phase_stats *ps = &m->phase[p];
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ps->lap_ms += elapsed_ms(&ps->lap_start, &now);
+    ps->bytes += bytes;
+    ps->records += records;
+}
+
+void phase_laps_end(struct metrics *m, enum phase_id p) {
+    if (m == NULL || !m->phase[p].in_laps)
+        return;
+    struct phase_stats *ps = &m->phase[p];
+    struct timespec wall_end, cpu_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+    double wall = elapsed_ms(&ps->wall_start, &wall_end);
+    double share = wall > ps->lap_ms ? ps->lap_ms / wall : 1;
+    if (m->perf.available) {
+        uint64_t hw_end[HW_COUNT];
+        perf_counters_read(&m->perf, hw_end);
+        for (int c = 0; c < HW_COUNT; c++)
+            ps->hw[c] += (uint64_t) ((hw_end[c] - ps->hw_start[c]) * share);
+    }
+    ps->wall_ms += ps->lap_ms;
+    ps->cpu_ms += elapsed_ms(&ps->cpu_start, &cpu_end) * share;
+    ps->lap_ms = 0;
+    ps->in_laps = false;
+}
+
+void print_phase_report(FILE *out, struct metrics *m) {
+    fprintf(out, "%-20s %12s %12s %14s %10s %12s\n", "Phase", "Wall (ms)", "CPU (ms)", "Bytes", "MB/s", "Records/s");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        struct phase_stats *ps = &m->phase[p];
+        double secs = ps->wall_ms / 1000.0;
+        double mbps = secs > 0 ? ps->bytes / secs / 1e6 : 0;
+        double rps = secs > 0 ? ps->records / secs : 0;
+        fprintf(out, "%-20s %12.1f %12.1f %14llu %10.1f %12.0f\n", phase_names[p], ps->wall_ms, ps->cpu_ms,
+                (unsigned long long) ps->bytes, mbps, rps);
+    }
+    fprintf(out, "(fetch I/O is part of the probe time)\n");
+}
+
+long peak_rss_kb(void) {
+    long rss, peak;
+    read_rss_kb(&rss, &peak);
+    return peak;
+}
+
+void read_rss_kb(long *rss, long *peak) {
+    *rss = -1;
+    *peak = -1;
+    FILE *fp = fopen("/proc/self/status", "r");
+    if (fp != NULL) {
+        char buf[256];
+        while (fgets(buf, sizeof(buf), fp) != NULL) {
+            sscanf(buf, "VmRSS: %ld", rss);
+            sscanf(buf, "VmHWM: %ld", peak);
+        }
+        fclose(fp);
+    }
+    if (*peak < 0) {
+        struct rusage ru;
+        if (getrusage(RUSAGE_SELF, &ru) == 0)
+            *peak = ru.ru_maxrss;
+    }
+    // the kernel only updates VmHWM now and then, so it can lag behind VmRSS
+    if (*peak < *rss)
+        *peak = *rss;
+}
+
+void print_memory_report(FILE *out, struct metrics *m) {
+    fprintf(out, "%-28s %16s %16s\n", "Memory (bytes)", "Allocated", "Peak held");
+    for (int c = 0; c < MEM_COUNT; c++)
+        fprintf(out, "%-28s %16llu %16llu\n", mem_names[c], (unsigned long long) m->mem_total[c],
+                (unsigned long long) m->mem_peak[c]);
+    struct run_counters *rc = &m->counters;
+    if (rc->huge_requested > 0)
+        fprintf(out, "Huge pages: asked for %llu bytes, %llu from the hugetlb pool, %llu transparent huge pages in use\n",
+                (unsigned long long) rc->huge_requested, (unsigned long long) rc->huge_hugetlb,
+                (unsigned long long) rc->huge_thp);
+    fprintf(out, "%-20s %14s %14s\n", "Phase", "RSS (kB)", "Peak RSS (kB)");
+    for (int p = 0; p < PHASE_COUNT; p++)
+        if (p != PHASE_FETCH && m->phase[p].peak_rss_kb > 0)
+            fprintf(out, "%-20s %14ld %14ld\n", phase_names[p], m->phase[p].rss_kb, m->phase[p].peak_rss_kb);
+}
+
+void print_hw_report(FILE *out, struct metrics *m) {
+    if (!m->perf.available)
+        return;
+    fprintf(out, "%-20s", "Phase");
+    for (int c = 0; c < HW_COUNT; c++)
+        fprintf(out, " %15s", hw_counter_name(c));
+    fprintf(out, " %6s\n", "IPC");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        uint64_t *hw = m->phase[p].hw;
+        fprintf(out, "%-20s", phase_names[p]);
+        for (int c = 0; c < HW_COUNT; c++)
+            fprintf(out, " %15llu", (unsigned long long) hw[c]);
+        fprintf(out, " %6.2f\n", hw[HW_CYCLES] ? (double) hw[HW_INSTRUCTIONS] / hw[HW_CYCLES] : 0);
+    }
+}
+
+// write a JSON string, escaping the characters that need it
+static void json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(out, "\\%c", *s);
+        else if ((unsigned char) *s < 0x20)
+            fprintf(out, "\\u%04x", *s);
+        else
+            fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+#define JSON_U64(name, value) fprintf(out, "    \"%s\": %llu,\n", name, (unsigned long long) (value))
+#define JSON_BOOL(name, value) fprintf(out, "    \"%s\": %s,\n", name, (value) ? "true" : "false")
+
+int write_metrics_json(const char *filename, struct metrics *m, struct options *opt,
+                       const char *left_fn, const char *right_fn, double elapsed_ms) {
+    FILE *out = fopen(filename, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Can't open metrics file %s\n", filename);
+        return -1;
+    }
+    struct run_counters *c = &m->counters;
+
+    fprintf(out, "{\n  \"version\": ");
+    json_string(out, FASTQ_PAIR_VERSION);
+    fprintf(out, ",\n  \"configuration\": {\n    \"left_file\": ");
+    json_string(out, left_fn);
+    fprintf(out, ",\n    \"right_file\": ");
+    json_string(out, right_fn);
+    fprintf(out, ",\n");
+    JSON_U64("tablesize", opt->tablesize);
+    fprintf(out, "    \"order\": \"%s\",\n", opt->order == ORDER_LEFT ? "left" : "right");
+    fprintf(out, "    \"index\": \"%s\",\n", opt->index == INDEX_MPHF ? "mphf" : "hash");
+    fprintf(out, "    \"threads\": %d,\n", opt->threads);
+    fprintf(out, "    \"shard\": %u,\n    \"nshards\": %u,\n", (unsigned) opt->shard, (unsigned) (opt->nshards > 1 ? opt->nshards : 1));
+    fprintf(out, "    \"huge_pages\": \"%s\",\n", huge_pages_name(opt->huge_pages));
+    JSON_BOOL("deduplicate", opt->deduplicate);
+    JSON_BOOL("formatid", opt->formatid);
+    JSON_BOOL("splitspace", opt->splitspace);
+    JSON_BOOL("plain_ids", opt->plain_ids);
+    JSON_BOOL("print_table_counts", opt->print_table_counts);
+    JSON_BOOL("dump_table", opt->dump_table);
+    fprintf(out, "    \"progress_interval\": %g,\n", opt->progress_interval);
+    fprintf(out, "    \"kernel_level\": \"%s\",\n", kernel_level());
+    JSON_BOOL("gzip_left", c->is_gzip_left);
+    JSON_BOOL("gzip_right", c->is_gzip_right);
+    fprintf(out, "    \"gzip_output\": %s\n  },\n", c->is_gzip_out ? "true" : "false");
+
+    fprintf(out, "  \"counters\": {\n");
+    JSON_U64("left_records", c->left_records);
+    JSON_U64("right_records", c->right_records);
+    JSON_U64("left_bytes", c->left_bytes);
+    JSON_U64("right_bytes", c->right_bytes);
+    JSON_U64("left_paired", c->left_paired);
+    JSON_U64("right_paired", c->right_paired);
+    JSON_U64("left_single", c->left_single);
+    JSON_U64("right_single", c->right_single);
+    JSON_U64("left_duplicates", c->left_duplicates);
+    JSON_U64("right_duplicates", c->right_duplicates);
+    JSON_U64("left_seeks", c->left_seeks);
+    JSON_U64("bytes_reinflated", c->bytes_reinflated);
+    JSON_U64("index_entries", c->index_entries);
+    JSON_U64("index_bytes", c->index_bytes);
+    JSON_U64("huge_requested", c->huge_requested);
+    JSON_U64("huge_hugetlb", c->huge_hugetlb);
+    JSON_U64("huge_thp", c->huge_thp);
+    fprintf(out, "    \"peak_rss_kb\": %ld\n  },\n", peak_rss_kb());
+
+    fprintf(out, "  \"memory\": {\n");
+    for (int c = 0; c < MEM_COUNT; c++)
+        fprintf(out, "    \"%s\": {\"allocated\": %llu, \"peak\": %llu}%s\n", mem_names[c],
+                (unsigned long long) m->mem_total[c], (unsigned long long) m->mem_peak[c], c == MEM_COUNT - 1 ? "" : ",");
+    fprintf(out, "  },\n");
+
+    fprintf(out, "  \"elapsed_ms\": %.3f,\n  \"phases\": [\n", elapsed_ms);
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        struct phase_stats *ps = &m->phase[p];
+        fprintf(out, "    {\"name\": \"%s\", \"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"bytes\": %llu, \"records\": %llu, "
+                     "\"rss_kb\": %ld, \"peak_rss_kb\": %ld",
+                phase_names[p], ps->wall_ms, ps->cpu_ms, (unsigned long long) ps->bytes,
+                (unsigned long long) ps->records, ps->rss_kb, ps->peak_rss_kb);
+        if (m->perf.available) {
+            fprintf(out, ", \"cycles\": %llu, \"instructions\": %llu, \"llc_misses\": %llu, "
+                         "\"branch_misses\": %llu, \"dtlb_misses\": %llu",
+                    (unsigned long long) ps->hw[HW_CYCLES], (unsigned long long) ps->hw[HW_INSTRUCTIONS],
+                    (unsigned long long) ps->hw[HW_LLC_MISSES], (unsigned long long) ps->hw[HW_BRANCH_MISSES],
+                    (unsigned long long) ps->hw[HW_DTLB_MISSES]);
+        }
+        fprintf(out, "}%s\n", p == PHASE_COUNT - 1 ? "" : ",");
+    }
+    fprintf(out, "  ]\n}\n");
+
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Can't write metrics file %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
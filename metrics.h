@@ -0,0 +1,188 @@
+//
+// Per-phase timing and throughput accounting for pair_files().
+//
+// Each phase accumulates wall time (CLOCK_MONOTONIC), process CPU time
+// (CLOCK_PROCESS_CPUTIME_ID), the bytes processed and the number of records
+// handled. A phase can be entered more than once and the times add up. The fetch I/O
+// happens once per matched pair, so it is timed in laps (see phase_lap_begin).
+//
+
+#ifndef FASTQ_PAIR_METRICS_H
+#define FASTQ_PAIR_METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "perf_counters.h"
+
+/*
+ * The phases are named for what they do, not for a file: the indexed file is the first one,
+ * or the second with --order left, and the other one is streamed
+ */
+enum phase_id {
+    PHASE_SNIFF,        // test whether the inputs are gzipped
+    PHASE_INDEX,        // read the indexed file and build the index
+    PHASE_TABLE_STATS,  // optional -p table report
+    PHASE_PROBE,        // read the streamed file and look up the mates
+    PHASE_FETCH,        // seek into the indexed file and copy the mate (nested in PHASE_PROBE)
+    PHASE_SINGLES,      // write the unpaired reads of the indexed file
+    PHASE_CLOSE,        // close and flush the input and output files
+    PHASE_TEARDOWN,     // free the index
+    PHASE_COUNT
+};
+
+/*
+ * What the memory we allocate is used for
+ */
+enum mem_category {
+    MEM_INDEX,          // the hash tables and the idloc structs (in the arena)
+    MEM_IDS,            // the parts of the id strings too long to fit in their idloc
+    MEM_IO_BUFFERS,     // the line buffers, stdio buffers and (an estimate of) zlib's buffers
+    MEM_COUNT
+};
+
+struct phase_stats {
+    double wall_ms;
+    double cpu_ms;
+    uint64_t bytes;
+    uint64_t records;
+    long rss_kb;        // resident set size when the phase last ended
+    long peak_rss_kb;   // peak resident set size when the phase last ended
+    struct timespec wall_start;
+    struct timespec cpu_start;
+    uint64_t hw[HW_COUNT];          // hardware counter totals, if we have them
+    uint64_t hw_start[HW_COUNT];
+    struct timespec lap_start;      // the laps since phase_laps_end (see phase_lap_begin)
+    double lap_ms;
+    bool in_laps;
+};
+
+/*
+ * The counters that pair_files() fills in as it goes. Bytes are uncompressed
+ * bytes, so for gzipped input they are the inflated sizes.
+ */
+struct run_counters {
+    uint64_t left_records;
+    uint64_t right_records;
+    uint64_t left_bytes;
+    uint64_t right_bytes;
+    uint64_t left_paired;
+    uint64_t right_paired;
+    uint64_t left_single;
+    uint64_t right_single;
+    uint64_t left_duplicates;
+    uint64_t right_duplicates;
+    uint64_t left_seeks;          // seeks into the indexed file (the left one unless --order left) to fetch a record
+    uint64_t bytes_reinflated;    // estimate of the data gzseek() had to inflate again to get there
+    uint64_t index_entries;
+    uint64_t index_bytes;         // table plus idloc structs plus id strings
+    uint64_t huge_requested;      // bytes of the index we asked to back with huge pages
+    uint64_t huge_hugetlb;        // how much of that came from the hugetlb pool
+    uint64_t huge_thp;            // transparent huge pages the process had once the files were paired
+    bool is_gzip_left;
+    bool is_gzip_right;
+    bool is_gzip_out;
+};
+
+struct metrics {
+    struct phase_stats phase[PHASE_COUNT];
+    struct run_counters counters;
+    uint64_t mem_total[MEM_COUNT];  // bytes allocated for each category over the whole run
+    uint64_t mem_live[MEM_COUNT];   // bytes we hold now
+    uint64_t mem_peak[MEM_COUNT];   // the most we held at once
+    struct perf_counters perf;      // perf.available is false unless --perf-counters worked
+};
+
+struct options;
+
+/*
+ * Return the name we print for a phase
+ */
+const char *phase_name(enum phase_id p);
+
+/*
+ * Start the clocks for a phase. m may be NULL, in which case nothing is recorded.
+ */
+void phase_begin(struct metrics *m, enum phase_id p);
+
+/*
+ * Stop the clocks for a phase and add the bytes and records processed since phase_begin
+ */
+void phase_end(struct metrics *m, enum phase_id p, uint64_t bytes, uint64_t records);
+
+/*
+ * Time a phase that is entered far too often to read the CPU clock and the hardware
+ * counters each time, such as the fetch of every mate. A lap only reads CLOCK_MONOTONIC,
+ * which needs no system call. The first lap after phase_laps_end also starts the CPU clock
+ * and the counters, and phase_laps_end stops them and gives the phase the share of the CPU
+ * time and counts that its laps took of the wall time since then. m may be NULL.
+ */
+void phase_lap_begin(struct metrics *m, enum phase_id p);
+
+/*
+ * End a lap, and add the bytes and records it processed
+ */
+void phase_lap_end(struct metrics *m, enum phase_id p, uint64_t bytes, uint64_t records);
+
+/*
+ * Add up the laps since the last call, e.g. at the end of each batch of records
+ */
+void phase_laps_end(struct metrics *m, enum phase_id p);
+
+/*
+ * Record that we allocated bytes of memory in a category. m may be NULL.
+ */
+static inline void mem_account(struct metrics *m, enum mem_category c, uint64_t bytes) {
+    if (m == NULL)
+        return;
+    m->mem_total[c] += bytes;
+    m->mem_live[c] += bytes;
+    if (m->mem_live[c] > m->mem_peak[c])
+        m->mem_peak[c] = m->mem_live[c];
+}
+
+/*
+ * Record that we freed bytes of memory in a category. m may be NULL.
+ */
+static inline void mem_release(struct metrics *m, enum mem_category c, uint64_t bytes) {
+    if (m == NULL)
+        return;
+    m->mem_live[c] -= bytes;
+}
+
+/*
+ * Print a table with wall time, cpu time, bytes, MB/s and records/s for each phase
+ */
+void print_phase_report(FILE *out, struct metrics *m);
+
+/*
+ * Print cycles, instructions, IPC, cache, branch and TLB misses for each phase
+ */
+void print_hw_report(FILE *out, struct metrics *m);
+
+/*
+ * Return the peak resident set size of this process in kilobytes
+ */
+long peak_rss_kb(void);
+
+/*
+ * Read the current and the peak resident set size in kilobytes from /proc/self/status,
+ * or from getrusage() (which only knows the peak, and counts the memory of the process
+ * before exec()) where there is no /proc
+ */
+void read_rss_kb(long *rss, long *peak);
+
+/*
+ * Print the memory allocated in each category and the peak RSS at the end of each phase
+ */
+void print_memory_report(FILE *out, struct metrics *m);
+
+/*
+ * Write all the counters, phase timings, the configuration and the version as a JSON document
+ * to filename. Returns 0 on success and -1 if the file could not be written.
+ */
+int write_metrics_json(const char *filename, struct metrics *m, struct options *opt,
+                       const char *left_fn, const char *right_fn, double elapsed_ms);
+
+#endif //FASTQ_PAIR_METRICS_H
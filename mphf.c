@@ -0,0 +1,286 @@
+//
+// A minimal perfect hash function over a fixed set of 64 bit keys, in the style of BBHash.
+//
+
+#include "mphf.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RANK_WORDS 8                // a rank count every 512 bits
+#define MIN_KEYS_PER_THREAD 65536
+
+// the murmur3 finaliser
+static inline uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// the bit of a level that key lands on, without a division
+static inline uint64_t level_position(uint64_t key, int level, uint64_t bits) {
+    uint64_t h = mix64(key + (uint64_t) (level + 1) * 0x9e3779b97f4a7c15ULL);
+    return (uint64_t) (((unsigned __int128) h * bits) >> 64);
+}
+
+uint64_t mphf_key(const char *s) {
+    size_t len = strlen(s);
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, s, 8);
+        h = (h ^ mix64(w)) * 0x87c37b91114253d5ULL;
+        s += 8;
+        len -= 8;
+    }
+    uint64_t w = 0;
+    memcpy(&w, s, len);
+    h = (h ^ mix64(w)) * 0x87c37b91114253d5ULL;
+    return mix64(h);
+}
+
+/*
+ * One thread's share of the keys of a level
+ */
+struct level_job {
+    const uint64_t *keys;
+    uint64_t begin, end;
+    uint64_t *a;                // the bits keys landed on
+    uint64_t *c;                // the bits more than one key landed on
+    uint64_t bits;
+    int level;
+    int pass;
+    uint64_t collided;          // after pass 1, how many keys go on to the next level
+    uint64_t *next;             // in pass 2, where they go
+};
+
+static void *level_worker(void *arg) {
+    struct level_job *j = arg;
+    if (j->pass == 0) {
+        for (uint64_t i = j->begin; i < j->end; i++) {
+            uint64_t p = level_position(j->keys[i], j->level, j->bits);
+            uint64_t bit = 1ULL << (p & 63);
+            if (__atomic_fetch_or(&j->a[p >> 6], bit, __ATOMIC_RELAXED) & bit)
+                __atomic_fetch_or(&j->c[p >> 6], bit, __ATOMIC_RELAXED);
+        }
+    } else if (j->pass == 1) {
+        j->collided = 0;
+        for (uint64_t i = j->begin; i < j->end; i++) {
+            uint64_t p = level_position(j->keys[i], j->level, j->bits);
+            j->collided += (j->c[p >> 6] >> (p & 63)) & 1;
+        }
+    } else {
+        uint64_t *out = j->next;
+        for (uint64_t i = j->begin; i < j->end; i++) {
+            uint64_t p = level_position(j->keys[i], j->level, j->bits);
+            if ((j->c[p >> 6] >> (p & 63)) & 1)
+                *out++ = j->keys[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Run a pass of every job, on a thread each. If a thread can't be started its job runs here.
+ */
+static void run_pass(struct level_job *jobs, int njobs, int pass) {
+    pthread_t tid[njobs];
+    bool started[njobs];
+    for (int t = 0; t < njobs; t++) {
+        jobs[t].pass = pass;
+        started[t] = t > 0 && pthread_create(&tid[t], NULL, level_worker, &jobs[t]) == 0;
+    }
+    for (int t = 0; t < njobs; t++)
+        if (!started[t])
+            level_worker(&jobs[t]);
+    for (int t = 1; t < njobs; t++)
+        if (started[t])
+            pthread_join(tid[t], NULL);
+}
+
+static int compare_keys(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Sort the keys and drop the repeats. Returns how many are left.
+ */
+static uint64_t sort_unique(uint64_t *keys, uint64_t n) {
+    qsort(keys, n, sizeof(*keys), compare_keys);
+    uint64_t distinct = 0;
+    for (uint64_t i = 0; i < n; i++)
+        if (distinct == 0 || keys[i] != keys[distinct - 1])
+            keys[distinct++] = keys[i];
+    return distinct;
+}
+
+int mphf_build(struct mphf *f, const uint64_t *keys, uint64_t n, int threads, enum huge_pages huge) {
+    memset(f, 0, sizeof(*f));
+    f->huge = huge;
+    uint64_t *level_words[MPHF_MAX_LEVELS];
+    const uint64_t *current = keys;
+    uint64_t *owned = NULL;     // the keys of the level we are on, unless it is the first
+    uint64_t remaining = n;
+    uint64_t nwords = 0;
+    int levels = 0;
+    bool deduped = false;
+
+    while (remaining > 0 && levels < MPHF_MAX_LEVELS) {
+        uint64_t bits = (uint64_t) (remaining * MPHF_GAMMA);
+        bits = (bits + 63) & ~(uint64_t) 63;
+        if (bits < 64)
+            bits = 64;
+        uint64_t words = bits / 64;
+        uint64_t *a = calloc(words, sizeof(*a));
+        uint64_t *c = calloc(words, sizeof(*c));
+        if (a == NULL || c == NULL) {
+            free(a);
+            free(c);
+            goto nomem;
+        }
+
+        int njobs = threads < 1 ? 1 : threads;
+        if ((uint64_t) njobs > remaining / MIN_KEYS_PER_THREAD + 1)
+            njobs = (int) (remaining / MIN_KEYS_PER_THREAD + 1);
+        struct level_job jobs[njobs];
+        for (int t = 0; t < njobs; t++) {
+            jobs[t].keys = current;
+            jobs[t].begin = remaining * t / njobs;
+            jobs[t].end = remaining * (t + 1) / njobs;
+            jobs[t].a = a;
+            jobs[t].c = c;
+            jobs[t].bits = bits;
+            jobs[t].level = levels;
+        }
+        run_pass(jobs, njobs, 0);
+        run_pass(jobs, njobs, 1);
+        uint64_t collided = 0;
+        for (int t = 0; t < njobs; t++)
+            collided += jobs[t].collided;
+        uint64_t *next = NULL;
+        if (collided > 0) {
+            if ((next = malloc(collided * sizeof(*next))) == NULL) {
+                free(a);
+                free(c);
+                goto nomem;
+            }
+            uint64_t at = 0;
+            for (int t = 0; t < njobs; t++) {
+                jobs[t].next = next + at;
+                at += jobs[t].collided;
+            }
+            run_pass(jobs, njobs, 2);
+        }
+        for (uint64_t w = 0; w < words; w++)
+            a[w] &= ~c[w];
+        free(c);
+
+        level_words[levels] = a;
+        f->level_start[levels] = nwords * 64;
+        f->level_bits[levels] = bits;
+        nwords += words;
+        levels++;
+        free(owned);
+        owned = next;
+        current = next;
+        // a repeated key collides with itself on every level, so once most keys are placed
+        // (or none were) we take the repeats out, and one copy of each gets a bit
+        bool stuck = collided == remaining;
+        if (collided > 0 && !deduped && (stuck || collided <= n / 4)) {
+            collided = sort_unique(next, collided);
+            deduped = true;
+            stuck = false;
+        }
+        remaining = collided;
+        if (stuck)
+            break;
+    }
+
+    // the keys that no level placed
+    if (remaining > 0) {
+        f->nfallback = sort_unique(owned, remaining);
+        f->fallback = owned;
+        owned = NULL;
+    }
+
+    // put the levels together, with the rank counts
+    f->levels = levels;
+    f->nwords = nwords;
+    f->bits = huge_alloc((nwords ? nwords : 1) * sizeof(*f->bits), huge, NULL);
+    f->ranks = calloc(nwords / RANK_WORDS + 1, sizeof(*f->ranks));
+    if (f->bits == NULL || f->ranks == NULL)
+        goto nomem;
+    for (int l = 0; l < levels; l++) {
+        memcpy(f->bits + f->level_start[l] / 64, level_words[l], f->level_bits[l] / 8);
+        free(level_words[l]);
+        level_words[l] = NULL;
+    }
+    uint64_t rank = 0;
+    for (uint64_t w = 0; w < nwords; w++) {
+        if (w % RANK_WORDS == 0)
+            f->ranks[w / RANK_WORDS] = rank;
+        rank += __builtin_popcountll(f->bits[w]);
+    }
+    f->nranked = rank;
+    f->nkeys = rank + f->nfallback;
+    return 0;
+
+nomem:
+    for (int l = 0; l < levels; l++)
+        free(level_words[l]);
+    free(owned);
+    mphf_free(f);
+    return -1;
+}
+
+uint64_t mphf_lookup(const struct mphf *f, uint64_t key) {
+    for (int l = 0; l < f->levels; l++) {
+        uint64_t p = f->level_start[l] + level_position(key, l, f->level_bits[l]);
+        uint64_t w = p >> 6;
+        uint64_t word = f->bits[w];
+        if ((word >> (p & 63)) & 1) {
+            uint64_t rank = f->ranks[w / RANK_WORDS];
+            for (uint64_t i = w & ~(uint64_t) (RANK_WORDS - 1); i < w; i++)
+                rank += __builtin_popcountll(f->bits[i]);
+            return rank + __builtin_popcountll(word & ((1ULL << (p & 63)) - 1));
+        }
+    }
+    // binary search the fallback
+    uint64_t lo = 0, hi = f->nfallback;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (f->fallback[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < f->nfallback && f->fallback[lo] == key)
+        return f->nranked + lo;
+    return MPHF_NONE;
+}
+
+void mphf_prefetch(const struct mphf *f, uint64_t key) {
+    if (f->levels > 0)
+        __builtin_prefetch(&f->bits[(f->level_start[0] + level_position(key, 0, f->level_bits[0])) >> 6]);
+}
+
+uint64_t mphf_bytes(const struct mphf *f) {
+    return (f->nwords + f->nwords / RANK_WORDS + 1 + f->nfallback) * sizeof(uint64_t);
+}
+
+void mphf_free(struct mphf *f) {
+    huge_free(f->bits, (f->nwords ? f->nwords : 1) * sizeof(*f->bits), f->huge);
+    free(f->ranks);
+    free(f->fallback);
+    f->bits = NULL;
+    f->ranks = NULL;
+    f->fallback = NULL;
+    f->nwords = 0;
+    f->levels = 0;
+    f->nkeys = f->nranked = f->nfallback = 0;
+}
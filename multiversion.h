@@ -0,0 +1,43 @@
+//
+// Build the hot kernels for several x86-64 microarchitecture levels.
+//
+// One binary runs on all of our nodes, so we can't use -march=native. Instead the
+// functions marked HOT_KERNEL are compiled once for each level and the dynamic linker
+// picks the best copy for the CPU when the program starts (an ifunc resolver that GCC
+// writes for us). On other compilers and architectures HOT_KERNEL does nothing.
+//
+// The string functions we lean on (strlen, strcmp, memchr inside fgets and gzgets) are
+// already dispatched like this by glibc. Don't mark small functions that the compiler
+// would otherwise inline, such as hash(): a call through the resolver costs more than
+// any level gains on a serial multiply-add loop.
+//
+
+#ifndef FASTQ_PAIR_MULTIVERSION_H
+#define FASTQ_PAIR_MULTIVERSION_H
+
+#if defined(FASTQ_PAIR_MULTIVERSION) && defined(__x86_64__) && defined(__linux__) && \
+    defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 12
+#define HOT_KERNEL_CLONES 1
+#define HOT_KERNEL __attribute__((target_clones("default", "arch=x86-64-v2", "arch=x86-64-v3", "arch=x86-64-v4")))
+#else
+#define HOT_KERNEL_CLONES 0
+#define HOT_KERNEL
+#endif
+
+/*
+ * The microarchitecture level whose copies of the kernels this CPU runs
+ */
+static inline const char *kernel_level(void) {
+#if HOT_KERNEL_CLONES
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("x86-64-v4"))
+        return "x86-64-v4";
+    if (__builtin_cpu_supports("x86-64-v3"))
+        return "x86-64-v3";
+    if (__builtin_cpu_supports("x86-64-v2"))
+        return "x86-64-v2";
+#endif
+    return "default";
+}
+
+#endif //FASTQ_PAIR_MULTIVERSION_H
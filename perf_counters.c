@@ -0,0 +1,124 @@
+//
+// Hardware performance counters for each phase, using perf_event_open(2).
+//
+
+#include "perf_counters.h"
+#include <string.h>
+
+static const char *hw_names[HW_COUNT] = {
+        "cycles",
+        "instructions",
+        "LLC misses",
+        "branch misses",
+        "dTLB misses",
+};
+
+const char *hw_counter_name(enum hw_counter c) {
+    return hw_names[c];
+}
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int open_counter(uint32_t type, uint64_t config, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = group_fd == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return (int) syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+bool perf_counters_open(struct perf_counters *pc) {
+    static const uint64_t cache_miss = PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+    const uint32_t types[HW_COUNT] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+                                      PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE};
+    const uint64_t configs[HW_COUNT] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                        PERF_COUNT_HW_CACHE_LL | cache_miss, PERF_COUNT_HW_BRANCH_MISSES,
+                                        PERF_COUNT_HW_CACHE_DTLB | cache_miss};
+
+    memset(pc, 0, sizeof(*pc));
+    int leader = -1;
+    int first_errno = 0;
+    for (int c = 0; c < HW_COUNT; c++) {
+        pc->fd[c] = open_counter(types[c], configs[c], leader);
+        pc->slot[c] = -1;
+        if (pc->fd[c] == -1) {
+            if (first_errno == 0)
+                first_errno = errno;
+            continue;
+        }
+        if (leader == -1)
+            leader = pc->fd[c];
+        pc->slot[c] = pc->nopen++;
+    }
+
+    if (leader == -1) {
+        int paranoid = -1;
+        FILE *fp = fopen("/proc/sys/kernel/perf_event_paranoid", "r");
+        if (fp != NULL) {
+            if (fscanf(fp, "%d", &paranoid) != 1)
+                paranoid = -1;
+            fclose(fp);
+        }
+        fprintf(stderr, "Hardware performance counters are not available (%s, perf_event_paranoid is %d). "
+                        "Continuing without them\n", strerror(first_errno), paranoid);
+        return false;
+    }
+
+    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    pc->available = true;
+    return true;
+}
+
+void perf_counters_read(struct perf_counters *pc, uint64_t values[HW_COUNT]) {
+    uint64_t buf[1 + HW_COUNT];
+    memset(values, 0, sizeof(uint64_t) * HW_COUNT);
+    if (!pc->available)
+        return;
+    int leader = -1;
+    for (int c = 0; c < HW_COUNT && leader == -1; c++)
+        leader = pc->fd[c];
+    if (read(leader, buf, sizeof(uint64_t) * (1 + pc->nopen)) <= 0)
+        return;
+    for (int c = 0; c < HW_COUNT; c++)
+        if (pc->slot[c] >= 0 && (uint64_t) pc->slot[c] < buf[0])
+            values[c] = buf[1 + pc->slot[c]];
+}
+
+void perf_counters_close(struct perf_counters *pc) {
+    for (int c = 0; c < HW_COUNT; c++)
+        if (pc->fd[c] != -1)
+            close(pc->fd[c]);
+    pc->available = false;
+}
+
+#else
+
+bool perf_counters_open(struct perf_counters *pc) {
+    memset(pc, 0, sizeof(*pc));
+    for (int c = 0; c < HW_COUNT; c++)
+        pc->fd[c] = pc->slot[c] = -1;
+    fprintf(stderr, "Hardware performance counters are only available on Linux. Continuing without them\n");
+    return false;
+}
+
+void perf_counters_read(struct perf_counters *pc, uint64_t values[HW_COUNT]) {
+    memset(values, 0, sizeof(uint64_t) * HW_COUNT);
+}
+
+void perf_counters_close(struct perf_counters *pc) {
+    pc->available = false;
+}
+
+#endif
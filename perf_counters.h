@@ -0,0 +1,50 @@
+//
+// Hardware performance counters for each phase, using perf_event_open(2).
+//
+// We open one group of counters for this process (user space only, so that the default
+// perf_event_paranoid setting of 2 allows it) and read the whole group with one read()
+// at the start and the end of each phase. Counters the CPU or the kernel does not support
+// are left out, and if none can be opened we say why and carry on without them.
+//
+
+#ifndef FASTQ_PAIR_PERF_COUNTERS_H
+#define FASTQ_PAIR_PERF_COUNTERS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+enum hw_counter {
+    HW_CYCLES,
+    HW_INSTRUCTIONS,
+    HW_LLC_MISSES,
+    HW_BRANCH_MISSES,
+    HW_DTLB_MISSES,
+    HW_COUNT
+};
+
+struct perf_counters {
+    int fd[HW_COUNT];           // -1 if the counter could not be opened
+    int slot[HW_COUNT];         // where the counter is in the group read, -1 if it is not there
+    int nopen;
+    bool available;
+};
+
+/*
+ * Open the counters. Returns false (and prints the reason to stderr) if none are available.
+ */
+bool perf_counters_open(struct perf_counters *pc);
+
+/*
+ * Read the current value of every counter into values (0 for the ones we could not open)
+ */
+void perf_counters_read(struct perf_counters *pc, uint64_t values[HW_COUNT]);
+
+void perf_counters_close(struct perf_counters *pc);
+
+/*
+ * The name we print for a counter
+ */
+const char *hw_counter_name(enum hw_counter c);
+
+#endif //FASTQ_PAIR_PERF_COUNTERS_H
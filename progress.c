@@ -0,0 +1,166 @@
+//
+// Progress reports for long runs.
+//
+
+#include "progress.h"
+#include "fastq_pair.h"
+#include "metrics.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void progress_init(struct progress *p, double interval, FILE *out) {
+    memset(p, 0, sizeof(*p));
+    p->enabled = interval > 0;
+    p->phase = "starting";
+    p->interval = interval;
+    p->out = out;
+    p->tty = isatty(fileno(out));
+    p->start = p->phase_start = p->last = now_s();
+    p->next_check = p->enabled ? PROGRESS_CHECK_RECORDS : UINT64_MAX;
+}
+
+void progress_export(struct progress *p, const char *filename, double interval, const char *left_fn,
+                     const char *right_fn) {
+    p->prom_file = filename;
+    p->prom_interval = interval;
+    p->left_fn = left_fn;
+    p->right_fn = right_fn;
+    p->enabled = true;
+    p->next_check = PROGRESS_CHECK_RECORDS;
+}
+
+// write a label value, escaping the characters Prometheus wants escaped
+static void prom_label(FILE *fp, const char *s) {
+    for (; *s != '\0'; s++) {
+        if (*s == '\n')
+            fputs("\\n", fp);
+        else if (*s == '"' || *s == '\\')
+            fprintf(fp, "\\%c", *s);
+        else
+            fputc(*s, fp);
+    }
+}
+
+#define PROM_GAUGE(name, help) fprintf(fp, "# HELP " name " " help "\n# TYPE " name " gauge\n" name)
+
+/*
+ * Write the textfile to a temporary file and rename it, so that the collector never
+ * sees half a file
+ */
+static void write_textfile(struct progress *p, double now, uint64_t records, uint64_t bytes, uint64_t position,
+                           bool done) {
+    size_t len = strlen(p->prom_file) + 8;
+    char *tmp = malloc(len);
+    if (tmp == NULL)
+        return;
+    snprintf(tmp, len, "%s.tmp", p->prom_file);
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Can't write the metrics textfile %s, no more live metrics will be written\n", tmp);
+        p->prom_file = NULL;
+        free(tmp);
+        return;
+    }
+
+    double elapsed = now - p->phase_start;
+    long rss, peak;
+    read_rss_kb(&rss, &peak);
+
+    PROM_GAUGE("fastq_pair_info", "The files being paired and the current phase");
+    fprintf(fp, "{left=\"");
+    prom_label(fp, p->left_fn);
+    fprintf(fp, "\",right=\"");
+    prom_label(fp, p->right_fn);
+    fprintf(fp, "\",phase=\"%s\",version=\"%s\"} 1\n", done ? "done" : p->phase, FASTQ_PAIR_VERSION);
+    PROM_GAUGE("fastq_pair_done", "1 once the run has finished");
+    fprintf(fp, " %d\n", done ? 1 : 0);
+    PROM_GAUGE("fastq_pair_elapsed_seconds", "Time since the run started");
+    fprintf(fp, " %.3f\n", now - p->start);
+    PROM_GAUGE("fastq_pair_phase_records", "Records processed in the current phase");
+    fprintf(fp, " %llu\n", (unsigned long long) records);
+    PROM_GAUGE("fastq_pair_phase_bytes", "Bytes processed in the current phase");
+    fprintf(fp, " %llu\n", (unsigned long long) bytes);
+    PROM_GAUGE("fastq_pair_records_per_second", "Records per second in the current phase");
+    fprintf(fp, " %.1f\n", elapsed > 0 ? records / elapsed : 0);
+    PROM_GAUGE("fastq_pair_bytes_per_second", "Bytes per second in the current phase");
+    fprintf(fp, " %.1f\n", elapsed > 0 ? bytes / elapsed : 0);
+    PROM_GAUGE("fastq_pair_phase_progress_ratio", "How far through the current phase we are");
+    fprintf(fp, " %.4f\n", done ? 1.0 : (p->total > 0 && position <= p->total ? (double) position / p->total : 0));
+    PROM_GAUGE("fastq_pair_index_entries", "IDs in the index of the first file");
+    fprintf(fp, " %llu\n", (unsigned long long) p->index_entries);
+    PROM_GAUGE("fastq_pair_index_load_factor", "IDs per bucket in the index of the first file");
+    fprintf(fp, " %.4f\n", p->tablesize ? (double) p->index_entries / p->tablesize : 0);
+    PROM_GAUGE("fastq_pair_resident_bytes", "Resident set size");
+    fprintf(fp, " %lld\n", rss * 1024LL);
+    PROM_GAUGE("fastq_pair_peak_resident_bytes", "Peak resident set size");
+    fprintf(fp, " %lld\n", peak * 1024LL);
+
+    if (fclose(fp) != 0 || rename(tmp, p->prom_file) != 0) {
+        fprintf(stderr, "Can't write the metrics textfile %s, no more live metrics will be written\n", p->prom_file);
+        p->prom_file = NULL;
+    }
+    free(tmp);
+}
+
+void progress_finish(struct progress *p) {
+    if (p->prom_file != NULL)
+        write_textfile(p, now_s(), 0, 0, 0, true);
+}
+
+void progress_phase(struct progress *p, const char *phase, uint64_t total) {
+    if (!p->enabled)
+        return;
+    p->phase = phase;
+    p->total = total;
+    p->phase_start = now_s();
+    p->next_check = PROGRESS_CHECK_RECORDS;
+    if (p->prom_file != NULL) {
+        p->prom_last = p->phase_start;
+        write_textfile(p, p->phase_start, 0, 0, 0, false);
+    }
+}
+
+void progress_report(struct progress *p, uint64_t records, uint64_t bytes, uint64_t position) {
+    if (!p->enabled)
+        return;
+    p->next_check = records + PROGRESS_CHECK_RECORDS;
+    double now = now_s();
+    if (p->prom_file != NULL && now - p->prom_last >= p->prom_interval) {
+        p->prom_last = now;
+        write_textfile(p, now, records, bytes, position, false);
+    }
+    if (p->interval <= 0 || now - p->last < p->interval)
+        return;
+    p->last = now;
+
+    double elapsed = now - p->phase_start;
+    double rate = elapsed > 0 ? records / elapsed : 0;
+    double mbps = elapsed > 0 ? bytes / elapsed / 1e6 : 0;
+    fprintf(p->out, "%s[%.0fs] %s: %llu records, %.1f MB, %.0f records/s, %.1f MB/s", p->tty ? "\r" : "",
+            now - p->start, p->phase, (unsigned long long) records, bytes / 1e6, rate, mbps);
+    if (p->total > 0 && position > 0 && position <= p->total) {
+        double eta = elapsed * (p->total - position) / position;
+        fprintf(p->out, ", %.1f%% done, ETA %.0fs", 100.0 * position / p->total, eta);
+    }
+    fprintf(p->out, "%s", p->tty ? "\033[K" : "\n");
+    fflush(p->out);
+}
+
+void progress_done(struct progress *p) {
+    if (!p->enabled)
+        return;
+    p->next_check = UINT64_MAX;
+    if (p->interval <= 0)
+        return;
+    // leave the last report on the screen
+    if (p->tty && p->last > p->phase_start)
+        fprintf(p->out, "\n");
+}
@@ -0,0 +1,84 @@
+//
+// Progress reports for long runs.
+//
+// The loops call progress_due() once per record. That is a single comparison with
+// a record count, and only every PROGRESS_CHECK_RECORDS records do we look at the clock
+// to see whether it is time to print another line. On a terminal the line is rewritten
+// in place, otherwise (e.g. a log file) every report is a new line.
+//
+// The same check also rewrites a Prometheus textfile (for the node exporter's textfile
+// collector) with the current rates, the index occupancy and the RSS, so that long jobs
+// can be watched on a dashboard while they run.
+//
+
+#ifndef FASTQ_PAIR_PROGRESS_H
+#define FASTQ_PAIR_PROGRESS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define PROGRESS_CHECK_RECORDS 16384
+
+struct progress {
+    bool enabled;           // either printing or exporting
+    bool tty;
+    FILE *out;
+    double interval;        // seconds between reports, 0 for none
+    double start;           // when we started
+    double phase_start;     // when the current phase started
+    double last;            // when we last printed
+    const char *prom_file;  // the Prometheus textfile, NULL for none
+    double prom_interval;   // seconds between rewrites of the textfile
+    double prom_last;       // when we last wrote it
+    const char *left_fn;    // the inputs, as labels in the textfile
+    const char *right_fn;
+    uint64_t index_entries; // set by the caller before progress_report
+    uint64_t tablesize;
+    const char *phase;
+    uint64_t total;         // the size of the input (or number of records) we are working through, 0 if unknown
+    uint64_t next_check;    // the record count at which we next look at the clock
+};
+
+/*
+ * Set up progress reports every interval seconds to out. An interval of 0 turns them off.
+ */
+void progress_init(struct progress *p, double interval, FILE *out);
+
+/*
+ * Also rewrite the Prometheus textfile filename every interval seconds. Call this
+ * after progress_init and before the first phase.
+ */
+void progress_export(struct progress *p, const char *filename, double interval, const char *left_fn,
+                     const char *right_fn);
+
+/*
+ * Write the textfile one last time, marking the run as finished
+ */
+void progress_finish(struct progress *p);
+
+/*
+ * Start a new phase. total is the size of the work (compressed bytes of the input, or the
+ * number of records) that the position passed to progress_report is measured against.
+ */
+void progress_phase(struct progress *p, const char *phase, uint64_t total);
+
+/*
+ * Print a report and rewrite the textfile if they are due. records and bytes are what we have done so far in this
+ * phase and position is how far we are through total.
+ */
+void progress_report(struct progress *p, uint64_t records, uint64_t bytes, uint64_t position);
+
+/*
+ * Finish the phase (and the line, on a terminal)
+ */
+void progress_done(struct progress *p);
+
+/*
+ * Is it worth calling progress_report yet? This is cheap enough for the inner loops.
+ */
+static inline bool progress_due(struct progress *p, uint64_t records) {
+    return records >= p->next_check;
+}
+
+#endif //FASTQ_PAIR_PROGRESS_H
@@ -0,0 +1,197 @@
+//
+// A compact index of the indexed file for --index mphf.
+//
+
+#include "static_index.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define STATIC_INDEX_INITIAL 65536
+
+void static_index_init(struct static_index *si, enum huge_pages huge) {
+    memset(si, 0, sizeof(*si));
+    si->huge = huge;
+}
+
+int static_index_add(struct static_index *si, uint64_t key, long pos, uint32_t len) {
+    if (si->nrecs == si->cap) {
+        uint64_t cap = si->cap ? 2 * si->cap : STATIC_INDEX_INITIAL;
+        uint64_t *keys = realloc(si->keys, cap * sizeof(*keys));
+        if (keys == NULL)
+            return -1;
+        si->keys = keys;
+        struct static_slot *recs = realloc(si->recs, cap * sizeof(*recs));
+        if (recs == NULL)
+            return -1;
+        si->recs = recs;
+        si->cap = cap;
+    }
+    si->keys[si->nrecs] = key;
+    si->recs[si->nrecs].pos = pos;
+    si->recs[si->nrecs].len = len;
+    si->recs[si->nrecs].fp = (uint32_t) (key >> 32);
+    si->nrecs++;
+    return 0;
+}
+
+// the bitmap for n slots
+static uint64_t bitmap_words(uint64_t n) {
+    return n / 64 + 1;
+}
+
+// by slot, and in the order of the file within a slot
+static int dup_order(const void *a, const void *b) {
+    const struct static_dup *x = a, *y = b;
+    if (x->slot != y->slot)
+        return x->slot < y->slot ? -1 : 1;
+    return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+int static_index_build(struct static_index *si, int threads) {
+    // give back what the doubling left over before the function and the slots need memory too
+    if (si->nrecs > 0 && si->nrecs < si->cap) {
+        uint64_t *keys = realloc(si->keys, si->nrecs * sizeof(*keys));
+        struct static_slot *recs = realloc(si->recs, si->nrecs * sizeof(*recs));
+        if (keys != NULL)
+            si->keys = keys;
+        if (recs != NULL)
+            si->recs = recs;
+        si->cap = si->nrecs;
+    }
+    if (mphf_build(&si->f, si->keys, si->nrecs, threads, si->huge) != 0)
+        return -1;
+    uint64_t n = si->f.nkeys;
+    si->slots = huge_alloc((n ? n : 1) * sizeof(*si->slots), si->huge, &si->usage);
+    si->printed_words = bitmap_words(n);
+    si->printed = calloc(si->printed_words, sizeof(*si->printed));
+    if (si->slots == NULL || si->printed == NULL)
+        return -1;
+
+    // the first record with each key gets the slot, so until we are done printed marks the slots we filled
+    uint64_t ndups = 0;
+    for (uint64_t i = 0; i < si->nrecs; i++) {
+        uint64_t slot = mphf_lookup(&si->f, si->keys[i]);
+        if (!static_index_printed(si, slot)) {
+            static_index_set_printed(si, slot);
+            si->slots[slot] = si->recs[i];
+        } else {
+            // we have read past the start of keys and recs, so the duplicates can go there
+            si->keys[ndups] = slot;
+            si->recs[ndups++] = si->recs[i];
+        }
+    }
+
+    // the duplicates get printed bits after the slots'
+    uint64_t *printed = realloc(si->printed, bitmap_words(n + ndups) * sizeof(*si->printed));
+    if (printed == NULL)
+        return -1;
+    si->printed = printed;
+    si->printed_words = bitmap_words(n + ndups);
+    memset(si->printed, 0, si->printed_words * sizeof(*si->printed));
+    if (ndups > 0) {
+        if ((si->dups = malloc(ndups * sizeof(*si->dups))) == NULL)
+            return -1;
+        for (uint64_t d = 0; d < ndups; d++) {
+            si->dups[d].slot = si->keys[d];
+            si->dups[d].pos = si->recs[d].pos;
+            si->dups[d].len = si->recs[d].len;
+            si->dups[d].back = 0;
+        }
+        si->ndups = ndups;
+        qsort(si->dups, ndups, sizeof(*si->dups), dup_order);
+    }
+    si->build_bytes = si->cap * (sizeof(*si->keys) + sizeof(*si->recs)) + static_index_bytes(si);
+
+    free(si->keys);
+    free(si->recs);
+    si->keys = NULL;
+    si->recs = NULL;
+    si->nrecs = si->cap = 0;
+    return 0;
+}
+
+int static_index_resolve(struct static_index *si, bool deduplicate, uint64_t *duplicates, static_same_id same, void *ctx) {
+    uint64_t kept = 0;
+    uint64_t d = 0;
+    while (d < si->ndups) {
+        uint64_t slot = si->dups[d].slot;
+        uint64_t group = kept;      // where the duplicates of this slot start once we have dropped some
+        for (; d < si->ndups && si->dups[d].slot == slot; d++) {
+            struct static_dup dup = si->dups[d];
+            int r = same(ctx, si->slots[slot].pos, dup.pos);
+            if (r < 0)
+                return -1;
+            dup.back = r ? STATIC_DUP_SLOT : 0;
+            // the key is shared by another ID: is it one of the earlier duplicates?
+            for (uint64_t e = group; e < kept && dup.back == 0; e++) {
+                if (si->dups[e].back != 0)
+                    continue;
+                if ((r = same(ctx, si->dups[e].pos, dup.pos)) < 0)
+                    return -1;
+                if (r)
+                    dup.back = (uint32_t) (kept - e);
+            }
+            if (deduplicate && dup.back != 0) {
+                (*duplicates)++;
+                continue;
+            }
+            si->dups[kept++] = dup;
+        }
+    }
+    si->ndups = kept;
+    return 0;
+}
+
+uint64_t static_index_dups(const struct static_index *si, uint64_t slot, uint64_t *first) {
+    uint64_t lo = 0, hi = si->ndups;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (si->dups[mid].slot < slot)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *first = lo;
+    while (hi < si->ndups && si->dups[hi].slot == slot)
+        hi++;
+    return hi - lo;
+}
+
+uint64_t static_index_keys(const struct static_index *si) {
+    return si->f.nkeys;
+}
+
+uint64_t static_index_bytes(const struct static_index *si) {
+    uint64_t n = si->f.nkeys;
+    return mphf_bytes(&si->f) + (n ? n : 1) * sizeof(*si->slots) + si->printed_words * sizeof(*si->printed) +
+           si->ndups * sizeof(*si->dups);
+}
+
+void print_static_index_stats(FILE *out, const struct static_index *si) {
+    const struct mphf *f = &si->f;
+    uint64_t n = f->nkeys;
+    uint64_t bytes = static_index_bytes(si);
+    fprintf(out, "Minimal perfect hash index statistics\n");
+    fprintf(out, "Keys: %llu Duplicates: %llu\n", (unsigned long long) n, (unsigned long long) si->ndups);
+    fprintf(out, "Levels: %d Keys in the fallback: %llu\n", f->levels, (unsigned long long) f->nfallback);
+    fprintf(out, "Hash function: %llu bytes (%.2f bits per key)\n", (unsigned long long) mphf_bytes(f),
+            n ? 8.0 * mphf_bytes(f) / n : 0);
+    fprintf(out, "Slots: %llu bytes (%zu bytes per key)\n", (unsigned long long) (n * sizeof(*si->slots)),
+            sizeof(*si->slots));
+    fprintf(out, "Memory: %llu bytes (%.1f bytes per entry), %llu bytes while it was built\n",
+            (unsigned long long) bytes, n + si->ndups ? (double) bytes / (n + si->ndups) : 0,
+            (unsigned long long) si->build_bytes);
+}
+
+void static_index_free(struct static_index *si) {
+    uint64_t n = si->f.nkeys;
+    huge_free(si->slots, (n ? n : 1) * sizeof(*si->slots), si->huge);
+    mphf_free(&si->f);
+    free(si->printed);
+    free(si->dups);
+    free(si->keys);
+    free(si->recs);
+    struct huge_usage usage = si->usage;
+    static_index_init(si, si->huge);
+    si->usage = usage;
+}
@@ -0,0 +1,151 @@
+//
+// A compact index of the indexed file for --index mphf.
+//
+// Once the indexed file has been read its set of IDs is fixed, so instead of a hash table
+// with a chain of idlocs and a copy of every ID we keep a minimal perfect hash function
+// over a 64 bit key of each ID (see mphf.h) and, for each key, one slot with the position
+// and length of its first record and a 32 bit fingerprint of the key. That is about 16
+// bytes per record instead of 40 plus the ID. A lookup reads the function (one or two
+// cache lines) and the slot (one more), and the fingerprint tells us whether the ID is in
+// the file, apart from one chance in 2^32. The caller confirms a match against the ID of
+// the record when it reads the record back, which it has to do anyway to write it out.
+//
+// Later records with the same key go in a list of duplicates, sorted by slot. Two different
+// IDs can have the same 64 bit key (with a billion reads, in a few runs in a hundred), so once
+// the index is built static_index_resolve reads the IDs of the duplicates back and marks each
+// one as a repeat of the slot's ID, a repeat of an earlier duplicate, or an ID of its own. A
+// lookup whose ID is not the slot's goes on to the duplicates with IDs of their own, and a
+// repeated ID is written as a single unless its ID is paired, as the hash table does.
+//
+
+#ifndef FASTQ_PAIR_STATIC_INDEX_H
+#define FASTQ_PAIR_STATIC_INDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "hugemem.h"
+#include "mphf.h"
+
+struct static_slot {
+    int64_t pos;            // where the record starts in the file
+    uint32_t len;           // the length of the record, 0 if it is too long to fit
+    uint32_t fp;            // the fingerprint of its key
+};
+
+#define STATIC_DUP_SLOT UINT32_MAX
+
+/*
+ * A record whose key we have already seen
+ */
+struct static_dup {
+    uint64_t slot;          // the slot of its key
+    int64_t pos;
+    uint32_t len;
+    uint32_t back;          // how many duplicates back the first record with its ID is: 0 if it is
+                            // this one, STATIC_DUP_SLOT if it is the slot's
+};
+
+/*
+ * Whether the records at positions a and b of the indexed file have the same ID: 1 if they
+ * do, 0 if they don't, -1 if they can't be read
+ */
+typedef int (*static_same_id)(void *ctx, int64_t a, int64_t b);
+
+struct static_index {
+    struct mphf f;
+    struct static_slot *slots;  // f.nkeys of them
+    uint64_t *printed;          // a bit for each slot and then each duplicate, set once its ID is paired
+    uint64_t printed_words;
+    struct static_dup *dups;
+    uint64_t ndups;
+    // the records as we read them, until static_index_build
+    uint64_t *keys;
+    struct static_slot *recs;
+    uint64_t nrecs;
+    uint64_t cap;
+    uint64_t build_bytes;       // the memory the build needed at its peak
+    enum huge_pages huge;
+    struct huge_usage usage;    // what we got for the slots
+};
+
+void static_index_init(struct static_index *si, enum huge_pages huge);
+
+/*
+ * The key we store for an ID
+ */
+static inline uint64_t static_index_key(const char *id) {
+    return mphf_key(id);
+}
+
+/*
+ * Add the next record, with the key of its ID. Returns 0, or -1 if there is no memory.
+ */
+int static_index_add(struct static_index *si, uint64_t key, long pos, uint32_t len);
+
+/*
+ * Build the function over the keys with threads threads and fill in the slots, in the
+ * order the records were added. Records with a key we have already seen go in the list of
+ * duplicates. Returns 0, or -1 if there is no memory.
+ */
+int static_index_build(struct static_index *si, int threads);
+
+/*
+ * Sort out which duplicates have the same ID as the slot or an earlier duplicate, and which
+ * only share its key, with same. With deduplicate, the repeated IDs are dropped and counted
+ * in *duplicates. Returns 0, or -1 if same could not read a record.
+ */
+int static_index_resolve(struct static_index *si, bool deduplicate, uint64_t *duplicates, static_same_id same, void *ctx);
+
+/*
+ * The slot that key would be in, if it is in the index at all. Call static_index_find
+ * with it.
+ */
+static inline uint64_t static_index_slot(const struct static_index *si, uint64_t key) {
+    return mphf_lookup(&si->f, key);
+}
+
+/*
+ * The slot for key, or NULL if key is not in the index. slot is from static_index_slot.
+ */
+static inline const struct static_slot *static_index_find(const struct static_index *si, uint64_t key, uint64_t slot) {
+    if (slot == MPHF_NONE || si->slots[slot].fp != (uint32_t) (key >> 32))
+        return NULL;
+    return &si->slots[slot];
+}
+
+static inline bool static_index_printed(const struct static_index *si, uint64_t slot) {
+    return (si->printed[slot / 64] >> (slot % 64)) & 1;
+}
+
+static inline void static_index_set_printed(struct static_index *si, uint64_t slot) {
+    si->printed[slot / 64] |= 1ULL << (slot % 64);
+}
+
+/*
+ * The printed bit of duplicate d: the one of the first record with its ID
+ */
+static inline uint64_t static_index_dup_bit(const struct static_index *si, uint64_t d) {
+    const struct static_dup *dup = &si->dups[d];
+    return dup->back == STATIC_DUP_SLOT ? dup->slot : si->f.nkeys + d - dup->back;
+}
+
+/*
+ * The duplicates in slot are dups[*first] to dups[*first + n - 1]. Returns n.
+ */
+uint64_t static_index_dups(const struct static_index *si, uint64_t slot, uint64_t *first);
+
+/*
+ * The keys in the index, and the memory the index uses once it is built
+ */
+uint64_t static_index_keys(const struct static_index *si);
+uint64_t static_index_bytes(const struct static_index *si);
+
+/*
+ * Print the size of the function and the slots, for -p
+ */
+void print_static_index_stats(FILE *out, const struct static_index *si);
+
+void static_index_free(struct static_index *si);
+
+#endif //FASTQ_PAIR_STATIC_INDEX_H
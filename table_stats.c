@@ -0,0 +1,98 @@
+//
+// Hash table health statistics.
+//
+
+#include "table_stats.h"
+#include <string.h>
+
+void compute_table_stats(struct table_stats *ts, struct idloc **table, uint64_t tablesize) {
+    memset(ts, 0, sizeof(*ts));
+    ts->buckets = tablesize;
+    ts->bytes = sizeof(*table) * tablesize;
+    for (uint64_t i = 0; i < tablesize; i++) {
+        uint64_t len = 0;
+        for (struct idloc *ptr = table[i]; ptr != NULL; ptr = ptr->next) {
+            len++;
+            ts->bytes += IDLOC_SLOT_BYTES + idloc_spill_bytes(ptr);
+            ts->inline_ids += idloc_inline(ptr);
+        }
+        ts->entries += len;
+        ts->probes += len * (len + 1) / 2;
+        if (len > 0)
+            ts->occupied++;
+        if (len > ts->max_chain)
+            ts->max_chain = len;
+        ts->hist[len < TABLE_HIST_BINS ? len : TABLE_HIST_BINS - 1]++;
+    }
+}
+
+/*
+ * The chain length that a fraction q of the entries sit in (or are shorter than)
+ */
+static uint64_t chain_percentile(struct table_stats *ts, double q) {
+    uint64_t want = (uint64_t) (q * ts->entries);
+    uint64_t seen = 0;
+    for (uint64_t len = 1; len < TABLE_HIST_BINS; len++) {
+        seen += ts->hist[len] * len;
+        if (seen >= want)
+            return len;
+    }
+    return ts->max_chain;
+}
+
+static bool is_prime(uint64_t n) {
+    if (n < 4)
+        return n > 1;
+    if (n % 2 == 0)
+        return false;
+    for (uint64_t d = 3; d * d <= n; d += 2)
+        if (n % d == 0)
+            return false;
+    return true;
+}
+
+void print_table_stats(FILE *out, struct table_stats *ts) {
+    double load = ts->buckets ? (double) ts->entries / ts->buckets : 0;
+    fprintf(out, "Hash table statistics\n");
+    fprintf(out, "Buckets: %llu Entries: %llu Load factor: %.3f\n",
+            (unsigned long long) ts->buckets, (unsigned long long) ts->entries, load);
+    fprintf(out, "Occupied buckets: %llu (%.1f%%)\n", (unsigned long long) ts->occupied,
+            ts->buckets ? 100.0 * ts->occupied / ts->buckets : 0);
+    fprintf(out, "Longest chain: %llu Mean probes per hit: %.2f\n", (unsigned long long) ts->max_chain,
+            ts->entries ? (double) ts->probes / ts->entries : 0);
+    if (ts->entries > 0)
+        fprintf(out, "Chain length per entry: p50 %llu p90 %llu p99 %llu max %llu\n",
+                (unsigned long long) chain_percentile(ts, 0.5), (unsigned long long) chain_percentile(ts, 0.9),
+                (unsigned long long) chain_percentile(ts, 0.99), (unsigned long long) ts->max_chain);
+    fprintf(out, "Memory: %llu bytes (%.1f bytes per entry)\n", (unsigned long long) ts->bytes,
+            ts->entries ? (double) ts->bytes / ts->entries : 0);
+    fprintf(out, "IDs stored inline: %llu (%.1f%%), longer than %d bytes: %llu\n",
+            (unsigned long long) ts->inline_ids, ts->entries ? 100.0 * ts->inline_ids / ts->entries : 0,
+            IDLOC_INLINE - 1, (unsigned long long) (ts->entries - ts->inline_ids));
+
+    fprintf(out, "Chain length\tBuckets\n");
+    for (int len = 0; len < TABLE_HIST_BINS; len++)
+        if (ts->hist[len] > 0)
+            fprintf(out, "%d%s\t%llu\n", len, len == TABLE_HIST_BINS - 1 ? "+" : "", (unsigned long long) ts->hist[len]);
+
+    // we aim for about one entry per bucket
+    uint64_t suggested = ts->entries | 1;
+    while (!is_prime(suggested))
+        suggested += 2;
+    if (load > 2)
+        fprintf(out, "Recommendation: the table is overloaded, increase -t to about %llu\n", (unsigned long long) suggested);
+    else if (load < 0.25 && ts->buckets > 100003)
+        fprintf(out, "Recommendation: the table is mostly empty, decrease -t to about %llu\n", (unsigned long long) suggested);
+    else
+        fprintf(out, "Recommendation: the table size is fine\n");
+}
+
+void dump_table(FILE *out, struct idloc **table, uint64_t tablesize) {
+    fprintf(out, "Bucket sizes\n");
+    for (uint64_t i = 0; i < tablesize; i++) {
+        uint64_t counter = 0;
+        for (struct idloc *ptr = table[i]; ptr != NULL; ptr = ptr->next)
+            counter++;
+        fprintf(out, "%llu\t%llu\n", (unsigned long long) i, (unsigned long long) counter);
+    }
+}
@@ -0,0 +1,48 @@
+//
+// Hash table health statistics.
+//
+// One pass over the buckets gives the load factor, the fraction of occupied buckets,
+// a histogram of the chain lengths (and percentiles from it), the longest chain, the
+// memory used per entry, how many IDs are stored inline and a suggested table size.
+// This replaces the old one line per bucket dump, which is still available with
+// --dump-table.
+//
+
+#ifndef FASTQ_PAIR_TABLE_STATS_H
+#define FASTQ_PAIR_TABLE_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "fastq_pair.h"
+#include "idloc.h"
+
+// chains this long or longer all land in the last histogram bin
+#define TABLE_HIST_BINS 64
+
+struct table_stats {
+    uint64_t buckets;
+    uint64_t entries;
+    uint64_t occupied;
+    uint64_t max_chain;
+    uint64_t probes;        // total comparisons to find every entry once
+    uint64_t inline_ids;    // entries whose ID is stored in the idloc itself
+    uint64_t bytes;         // table plus idloc structs plus id strings
+    uint64_t hist[TABLE_HIST_BINS];
+};
+
+/*
+ * Walk the table and fill in ts
+ */
+void compute_table_stats(struct table_stats *ts, struct idloc **table, uint64_t tablesize);
+
+/*
+ * Print the summary to out
+ */
+void print_table_stats(FILE *out, struct table_stats *ts);
+
+/*
+ * Print the number of entries in every bucket (the old -p output)
+ */
+void dump_table(FILE *out, struct idloc **table, uint64_t tablesize);
+
+#endif //FASTQ_PAIR_TABLE_STATS_H
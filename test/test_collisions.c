@@ -0,0 +1,155 @@
+//
+// Check that --index mphf pairs the right records when different IDs have the same key.
+//
+// A real 64 bit collision needs billions of reads, so we give the index a key with only
+// three bits: every slot is shared by many IDs. The pairs must be the same as with the
+// usual key (and the counts the same as with the hash table), with and without -d and -f.
+//
+// usage: test_collisions left.fastq right.fastq
+//
+// The outputs go in the directories usual/, collide/ and hash/ of the current directory.
+//
+
+#include "fastq_pair.h"
+#include "mphf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static uint64_t colliding_key(const char *id) {
+    return mphf_key(id) & 7;
+}
+
+static int copy_file(const char *from, const char *to) {
+    FILE *in = fopen(from, "rb");
+    FILE *out = fopen(to, "wb");
+    char buf[65536];
+    size_t n;
+    int err = in == NULL || out == NULL;
+    while (!err && (n = fread(buf, 1, sizeof(buf), in)) > 0)
+        err = fwrite(buf, 1, n, out) != n;
+    if (in != NULL)
+        fclose(in);
+    if (out != NULL && fclose(out) != 0)
+        err = 1;
+    return err;
+}
+
+static int cmp_lines(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/*
+ * The lines of fn, sorted, in *lines. Returns how many, or -1 if it can't be read.
+ */
+static long sorted_lines(const char *fn, char ***lines) {
+    FILE *fp = fopen(fn, "r");
+    if (fp == NULL)
+        return -1;
+    long n = 0, cap = 0;
+    char *line = NULL;
+    size_t size = 0;
+    *lines = NULL;
+    while (getline(&line, &size, fp) >= 0) {
+        if (n == cap) {
+            cap = cap ? 2 * cap : 1024;
+            *lines = realloc(*lines, cap * sizeof(**lines));
+        }
+        (*lines)[n++] = strdup(line);
+    }
+    free(line);
+    fclose(fp);
+    qsort(*lines, n, sizeof(**lines), cmp_lines);
+    return n;
+}
+
+/*
+ * Whether the files have the same lines, in any order
+ */
+static int same_lines(const char *a, const char *b) {
+    char **x, **y;
+    long nx = sorted_lines(a, &x), ny = sorted_lines(b, &y);
+    int same = nx >= 0 && nx == ny;
+    for (long i = 0; same && i < nx; i++)
+        same = strcmp(x[i], y[i]) == 0;
+    for (long i = 0; i < nx; i++)
+        free(x[i]);
+    for (long i = 0; i < ny; i++)
+        free(y[i]);
+    free(x);
+    free(y);
+    return same;
+}
+
+static int run(const char *dir, const char *left, const char *right, enum index_kind index,
+               uint64_t (*key)(const char *), bool deduplicate, bool formatid, struct run_counters *c) {
+    char l[256], r[256];
+    mkdir(dir, 0755);
+    snprintf(l, sizeof(l), "%s/left.fastq", dir);
+    snprintf(r, sizeof(r), "%s/right.fastq", dir);
+    if (copy_file(left, l) != 0 || copy_file(right, r) != 0) {
+        fprintf(stderr, "Can't copy the test files to %s\n", dir);
+        return 1;
+    }
+    struct options opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.tablesize = 1000;
+    opt.order = ORDER_RIGHT;
+    opt.index = index;
+    opt.threads = 2;
+    opt.index_key = key;
+    opt.huge_pages = HUGE_PAGES_OFF;
+    opt.splitspace = true;
+    opt.deduplicate = deduplicate;
+    opt.formatid = formatid;
+    struct pair_result res;
+    int err = pair_files(l, r, &opt, &res);
+    if (err != FQP_OK) {
+        fprintf(stderr, "%s: %s\n", dir, res.error);
+        return 1;
+    }
+    *c = res.counts;
+    return 0;
+}
+
+static int same_counts(const struct run_counters *a, const struct run_counters *b) {
+    return a->left_paired == b->left_paired && a->right_paired == b->right_paired &&
+           a->left_single == b->left_single && a->right_single == b->right_single &&
+           a->left_duplicates == b->left_duplicates && a->right_duplicates == b->right_duplicates;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s left.fastq right.fastq\n", argv[0]);
+        return 1;
+    }
+    const char *outputs[4] = {"left.paired.fastq", "right.paired.fastq", "left.single.fastq", "right.single.fastq"};
+    int status = 0;
+    for (int config = 0; config < 4; config++) {
+        bool deduplicate = config & 1, formatid = config & 2;
+        struct run_counters usual, collide, table;
+        if (run("usual", argv[1], argv[2], INDEX_MPHF, NULL, deduplicate, formatid, &usual) != 0 ||
+            run("collide", argv[1], argv[2], INDEX_MPHF, colliding_key, deduplicate, formatid, &collide) != 0 ||
+            run("hash", argv[1], argv[2], INDEX_HASH, NULL, deduplicate, formatid, &table) != 0)
+            return 1;
+        printf("%s%s: %llu pairs, %llu and %llu singles\n", deduplicate ? "-d " : "", formatid ? "-f" : "",
+               (unsigned long long) collide.left_paired, (unsigned long long) collide.left_single,
+               (unsigned long long) collide.right_single);
+        if (!same_counts(&usual, &collide) || !same_counts(&usual, &table)) {
+            fprintf(stderr, "The counts with colliding keys, the usual keys and the hash table differ\n");
+            status = 1;
+        }
+        for (int f = 0; f < 4; f++) {
+            char a[256], b[256];
+            snprintf(a, sizeof(a), "usual/%s", outputs[f]);
+            snprintf(b, sizeof(b), "collide/%s", outputs[f]);
+            if (!same_lines(a, b)) {
+                fprintf(stderr, "%s and %s differ\n", a, b);
+                status = 1;
+            }
+        }
+    }
+    printf("%s\n", status == 0 ? "PASS" : "FAIL");
+    return status;
+}
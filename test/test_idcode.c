@@ -0,0 +1,127 @@
+//
+// Check that the ID codec is lossless and never gives two IDs the same code: the hash
+// table compares codes to find mates, and -f writes the singles from decoded codes.
+//
+// usage: test_idcode
+//
+
+#include "idcode.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PREFIX "@A00123:456:HXXXXDSXY:"
+
+// the IDs we train the codec on: Illumina, so the prefix is PREFIX
+static const char *sample[] = {
+        PREFIX "1:1101:8919:1000",
+        PREFIX "1:1101:10004:1000",
+        PREFIX "2:2204:31105:36793",
+        PREFIX "4:1478:25183:6652",
+};
+
+static const char *ids[] = {
+        PREFIX "1:1101:8919:1000",
+        PREFIX "1:1101:8919:0100",
+        PREFIX "1:1101:8919:100",
+        PREFIX "01:1101:8919:1000",
+        PREFIX "1:1101:8919:1000 ",
+        // leading zeros
+        PREFIX "007",
+        PREFIX "07",
+        PREFIX "7",
+        PREFIX "0",
+        PREFIX "00",
+        "@007",
+        "@7",
+        "0",
+        "00",
+        // digit runs longer than 19, and the largest runs that fit
+        PREFIX "123456789012345678901234567890",
+        PREFIX "12345678901234567890",
+        PREFIX "1234567890123456789",
+        PREFIX "999999999999999999999",
+        PREFIX "9999999999999999999",
+        PREFIX "18446744073709551615",
+        PREFIX "99999999999999999990123",
+        // bytes of 0x80 or more, and the escape byte itself
+        PREFIX "\x80",
+        PREFIX "\xff" "1",
+        PREFIX "caf\xc3\xa9:12",
+        PREFIX "\x03",
+        PREFIX "\x03\x03" "5",
+        "\x03",
+        "\x01",
+        "\x02" "3",
+        "\x81\x82",
+        // IDs without the prefix, one that is the prefix, and ones a little shorter or longer
+        "@SRR1234567.1",
+        "@SRR1234567.10",
+        "@A00123:456:HXXXXDSXZ:1:1101:8919:1000",
+        "A00123:456:HXXXXDSXY:1:1101:8919:1000",
+        PREFIX,
+        "@A00123:456:HXXXXDSXY",
+        PREFIX ":",
+        "",
+        "x",
+};
+
+#define NIDS (sizeof(ids) / sizeof(ids[0]))
+
+/*
+ * Code every ID with c, decode it again, and check that no two codes are the same
+ */
+static int check(const struct id_codec *c) {
+    char *codes[NIDS];
+    int failures = 0;
+    for (size_t i = 0; i < NIDS; i++) {
+        size_t len = strlen(ids[i]);
+        codes[i] = malloc(2 * len + 2);
+        size_t clen = id_encode(c, ids[i], len, codes[i]);
+        if (strlen(codes[i]) != clen) {
+            fprintf(stderr, "The code of ID %zu has a NUL in it\n", i);
+            failures++;
+        }
+        char *back = malloc(id_decoded_max(c, clen) + 1);
+        size_t blen = id_decode(c, codes[i], back);
+        if (blen != len || strcmp(back, ids[i]) != 0) {
+            fprintf(stderr, "ID %zu, |%s|, came back as |%s|\n", i, ids[i], back);
+            failures++;
+        }
+        free(back);
+    }
+    for (size_t i = 0; i < NIDS; i++)
+        for (size_t j = i + 1; j < NIDS; j++)
+            if (strcmp(codes[i], codes[j]) == 0) {
+                fprintf(stderr, "IDs %zu, |%s|, and %zu, |%s|, have the same code\n", i, ids[i], j, ids[j]);
+                failures++;
+            }
+    for (size_t i = 0; i < NIDS; i++)
+        free(codes[i]);
+    return failures;
+}
+
+int main(void) {
+    char buf[1024];
+    size_t used = 0;
+    for (size_t i = 0; i < sizeof(sample) / sizeof(sample[0]); i++) {
+        memcpy(buf + used, sample[i], strlen(sample[i]) + 1);
+        used += strlen(sample[i]) + 1;
+    }
+    struct id_codec c;
+    id_codec_train(&c, buf, sizeof(sample) / sizeof(sample[0]));
+    int failures = 0;
+    if (!c.enabled || strcmp(c.prefix, PREFIX) != 0) {
+        fprintf(stderr, "The codec chose the prefix |%s| and is %s\n", c.prefix, c.enabled ? "on" : "off");
+        failures++;
+    }
+    failures += check(&c);
+
+    // and with no prefix at all
+    struct id_codec none;
+    id_codec_init(&none);
+    failures += check(&none);
+
+    printf("%zu IDs: %s\n", NIDS, failures == 0 ? "PASS" : "FAIL");
+    return failures != 0;
+}
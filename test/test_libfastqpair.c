@@ -0,0 +1,200 @@
+//
+// Pair two fastq files through the in-memory API of libfastqpair, with deduplication and a
+// table size of 1000 (like fastq_pair -d -t 1000), and check the counts. Then check that
+// the mate suffix of each side comes from its first records, not just the first one.
+//
+// usage: test_libfastqpair left.fastq right.fastq left_paired right_paired left_single right_single
+//                          left_duplicates right_duplicates
+//
+
+#include "libfastqpair.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct tally {
+    unsigned long pairs;
+    unsigned long singles[2];
+    unsigned long duplicates[2];
+    int mismatches;             // pairs whose IDs don't agree
+    struct id_rule rules[2];    // how each side marks its mates, as fastq_pair works it out
+};
+
+static int on_pair(void *user, const struct fqp_record *left, const struct fqp_record *right) {
+    struct tally *t = user;
+    char *l = malloc(strlen(left->header) + 1), *r = malloc(strlen(right->header) + 1);
+    if (l == NULL || r == NULL) {
+        fprintf(stderr, "Can't allocate memory for the IDs of %s and %s\n", left->header, right->header);
+        free(l);
+        free(r);
+        return 1;
+    }
+    normalise_id(&t->rules[FQP_LEFT], left->header, strlen(left->header), l);
+    normalise_id(&t->rules[FQP_RIGHT], right->header, strlen(right->header), r);
+    if (strcmp(l, r) != 0) {
+        fprintf(stderr, "%s was paired with %s\n", left->header, right->header);
+        t->mismatches++;
+    }
+    free(l);
+    free(r);
+    t->pairs++;
+    return 0;
+}
+
+static int on_single(void *user, enum fqp_side side, const struct fqp_record *rec) {
+    (void) rec;
+    ((struct tally *) user)->singles[side]++;
+    return 0;
+}
+
+static int on_duplicate(void *user, enum fqp_side side, const struct fqp_record *rec) {
+    (void) rec;
+    ((struct tally *) user)->duplicates[side]++;
+    return 0;
+}
+
+/*
+ * Work out the rule of a side from the first ID_RULE_RECORDS headers of fn
+ */
+static int file_rule(const char *fn, struct id_rule *rule) {
+    FILE *fp = fopen(fn, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Can't open file %s\n", fn);
+        return FQP_EOPEN;
+    }
+    id_rule_init(rule, true);
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    for (long n = 0; n < 4 * ID_RULE_RECORDS && (len = getline(&line, &size, fp)) >= 0; n++)
+        if (n % 4 == 0)
+            id_rule_observe(rule, line, len);
+    free(line);
+    fclose(fp);
+    return FQP_OK;
+}
+
+/*
+ * Read every record of fn and add it to the left or the right side
+ */
+static int add_file(struct fqp_context *ctx, const char *fn, enum fqp_side side) {
+    FILE *fp = fopen(fn, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Can't open file %s\n", fn);
+        return FQP_EOPEN;
+    }
+    char *lines[4] = {NULL, NULL, NULL, NULL};
+    size_t sizes[4] = {0, 0, 0, 0};
+    int err = FQP_OK;
+    while (err == FQP_OK && getline(&lines[0], &sizes[0], fp) >= 0) {
+        for (int i = 1; i < 4; i++)
+            if (getline(&lines[i], &sizes[i], fp) < 0 && lines[i] != NULL)
+                lines[i][0] = '\0';
+        struct fqp_record rec = {lines[0], lines[1], lines[2], lines[3]};
+        err = side == FQP_LEFT ? fqp_add_left(ctx, &rec) : fqp_add_right(ctx, &rec);
+    }
+    for (int i = 0; i < 4; i++)
+        free(lines[i]);
+    fclose(fp);
+    return err;
+}
+
+/*
+ * Left @x.1, @x.3 and right @x.2, @x.3: .3 is a read number, not a mate, so only the
+ * @x.3 records pair. Taking the rule from the first record would strip .1 and .2, and pair
+ * @x.1 with @x.2.
+ */
+static int check_rule_from_first_records(void) {
+    const char *left[2] = {"@x.1", "@x.3"}, *right[2] = {"@x.2", "@x.3"};
+    struct fqp_config cfg;
+    fqp_config_init(&cfg);
+    cfg.tablesize = 1000;
+    struct fqp_callbacks cb = {on_pair, on_single, on_duplicate};
+    struct tally t;
+    memset(&t, 0, sizeof(t));
+    for (int side = FQP_LEFT; side <= FQP_RIGHT; side++) {
+        id_rule_init(&t.rules[side], true);
+        for (int i = 0; i < 2; i++)
+            id_rule_observe(&t.rules[side], side == FQP_LEFT ? left[i] : right[i], 4);
+    }
+
+    struct fqp_context *ctx;
+    int err = fqp_new(&ctx, &cfg, &cb, &t);
+    for (int i = 0; err == FQP_OK && i < 2; i++) {
+        struct fqp_record rec = {left[i], "ACGT", "+", "IIII"};
+        err = fqp_add_left(ctx, &rec);
+    }
+    for (int i = 0; err == FQP_OK && i < 2; i++) {
+        struct fqp_record rec = {right[i], "ACGT", "+", "IIII"};
+        err = fqp_add_right(ctx, &rec);
+    }
+    if (err == FQP_OK)
+        err = fqp_finish(ctx);
+    if (err != FQP_OK) {
+        fprintf(stderr, "ERROR: %s (%s)\n", ctx != NULL ? fqp_error_message(ctx) : "", fqp_strerror(err));
+        fqp_free(ctx);
+        return 1;
+    }
+    const struct run_counters *c = fqp_counts(ctx);
+    printf("%-17s %lu pair, %lu and %lu singles (counted %llu, %llu and %llu, expected 1, 1 and 1)\n",
+           "read numbers", t.pairs, t.singles[FQP_LEFT], t.singles[FQP_RIGHT], (unsigned long long) c->left_paired,
+           (unsigned long long) c->left_single, (unsigned long long) c->right_single);
+    int status = t.mismatches > 0 || t.pairs != 1 || t.singles[FQP_LEFT] != 1 || t.singles[FQP_RIGHT] != 1 ||
+                 c->left_paired != 1 || c->left_single != 1 || c->right_single != 1;
+    fqp_free(ctx);
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 9) {
+        fprintf(stderr, "usage: %s left.fastq right.fastq left_paired right_paired left_single right_single "
+                        "left_duplicates right_duplicates\n", argv[0]);
+        return 1;
+    }
+
+    struct fqp_config cfg;
+    fqp_config_init(&cfg);
+    cfg.tablesize = 1000;
+    cfg.deduplicate = true;
+    struct fqp_callbacks cb = {on_pair, on_single, on_duplicate};
+    struct tally t;
+    memset(&t, 0, sizeof(t));
+
+    struct fqp_context *ctx = NULL;
+    int err = file_rule(argv[1], &t.rules[FQP_LEFT]);
+    if (err == FQP_OK)
+        err = file_rule(argv[2], &t.rules[FQP_RIGHT]);
+    if (err == FQP_OK)
+        err = fqp_new(&ctx, &cfg, &cb, &t);
+    if (err == FQP_OK)
+        err = add_file(ctx, argv[1], FQP_LEFT);
+    if (err == FQP_OK)
+        err = add_file(ctx, argv[2], FQP_RIGHT);
+    if (err == FQP_OK)
+        err = fqp_finish(ctx);
+    if (err != FQP_OK) {
+        fprintf(stderr, "ERROR: %s (%s)\n", ctx != NULL ? fqp_error_message(ctx) : "", fqp_strerror(err));
+        fqp_free(ctx);
+        return 1;
+    }
+
+    const struct run_counters *c = fqp_counts(ctx);
+    unsigned long got[6] = {t.pairs, t.pairs, t.singles[FQP_LEFT], t.singles[FQP_RIGHT],
+                            t.duplicates[FQP_LEFT], t.duplicates[FQP_RIGHT]};
+    unsigned long counted[6] = {c->left_paired, c->right_paired, c->left_single, c->right_single,
+                                c->left_duplicates, c->right_duplicates};
+    const char *names[6] = {"left paired", "right paired", "left single", "right single",
+                            "left duplicates", "right duplicates"};
+    int status = t.mismatches > 0;
+    for (int i = 0; i < 6; i++) {
+        unsigned long want = strtoul(argv[3 + i], NULL, 10);
+        printf("%-17s %lu (counted %lu, expected %lu)\n", names[i], got[i], counted[i], want);
+        if (got[i] != want || counted[i] != want)
+            status = 1;
+    }
+    fqp_free(ctx);
+    if (check_rule_from_first_records() != 0)
+        status = 1;
+    printf("%s\n", status == 0 ? "PASS" : "FAIL");
+    return status;
+}
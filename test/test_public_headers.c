@@ -0,0 +1,12 @@
+//
+// A program that only sees the installed headers, as one built against libfastqpair would.
+// It just has to compile.
+//
+
+#include <libfastqpair.h>
+
+int main(void) {
+    struct fqp_config cfg;
+    fqp_config_init(&cfg);
+    return cfg.tablesize == 0;
+}
@@ -0,0 +1,219 @@
+//
+// Check that the index works past 2^32: a table with more than 2^32 buckets, IDs of
+// reads numbered beyond 2^32 and file positions beyond 4 GB.
+//
+// A real input that size is terabytes, so the table is a sparse mapping that only uses
+// memory for the buckets we touch, and we index a sample of synthetic reads from the top
+// of the range rather than all of them.
+//
+// With pair, we run pair_files on a first file of more than 4 GB instead: a sparse file
+// that starts with thousands of copies of one record with megabase reads of NULs, which
+// -d reads past and drops, and then the mates of the second file's reads. Every position
+// in the index, the seeks to fetch the mates and the byte counters are past 2^32. (The
+// record counters would need 2^32 records, so only their type covers them.)
+//
+// usage: test_scaling [number of reads]
+//        test_scaling pair [directory]
+//
+// Exits with 77 (which ctest reports as skipped) if the system won't map the table, or
+// the file system can't make a sparse file.
+//
+
+#include "fastq_pair.h"
+#include "idloc.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BUCKETS ((3ULL << 31) + 1)  // about 6.4 billion
+#define FIRST_READ (1ULL << 32)
+#define RECORD_BYTES 300            // so the positions pass 4 GB too
+
+#define PAD_READ (1 << 20)                      // bases in each padding record
+#define PAD_RECORDS ((1ULL << 32) / (2 * PAD_READ) + 8)
+#define MATES 8
+
+/*
+ * The record of read k in file (1 or 2)
+ */
+static int mate_record(char *buf, size_t size, int k, int file) {
+    return snprintf(buf, size, "@read%d/%d\nACGT%06dTGCA\n+\nIIII%06dIIII\n", k, file, k * file, k * file);
+}
+
+/*
+ * Write the first file to fn: the padding, whose reads are holes, then read 1 to MATES and
+ * one without a mate. Returns 0, -1 if we can't write it, or 77 if it isn't sparse.
+ */
+static int write_first_file(const char *fn) {
+    int fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    off_t pos = 0;
+    int err = 0;
+    for (uint64_t r = 0; r < PAD_RECORDS && !err; r++) {
+        err = pwrite(fd, "@pad/1\n", 7, pos) != 7 || pwrite(fd, "\n+\n", 3, pos + 7 + PAD_READ) != 3 ||
+              pwrite(fd, "\n", 1, pos + 10 + 2 * PAD_READ) != 1;
+        pos += 11 + 2 * PAD_READ;
+    }
+    char rec[128];
+    for (int k = 1; k <= MATES + 1 && !err; k++) {
+        int len = mate_record(rec, sizeof(rec), k == MATES + 1 ? 1000 : k, 1);
+        err = pwrite(fd, rec, len, pos) != len;
+        pos += len;
+    }
+    struct stat st;
+    if (!err && fstat(fd, &st) == 0 && (uint64_t) st.st_blocks * 512 > (64 << 20)) {
+        close(fd);
+        unlink(fn);
+        return 77;
+    }
+    close(fd);
+    return err ? -1 : 0;
+}
+
+/*
+ * Pair the big first file with a small second one, with the index kind index
+ */
+static int pair_past_4gb(const char *dir, enum index_kind index) {
+    char left[512], right[512], paired[512];
+    snprintf(left, sizeof(left), "%s/big_1.fastq", dir);
+    snprintf(right, sizeof(right), "%s/big_2.fastq", dir);
+    snprintf(paired, sizeof(paired), "%s/big_1.paired.fastq", dir);
+    int err = write_first_file(left);
+    if (err != 0) {
+        if (err == 77)
+            printf("SKIP: %s is not sparse\n", left);
+        else
+            fprintf(stderr, "Can't write %s\n", left);
+        return err == 77 ? 77 : 1;
+    }
+    // the mates, backwards, and one read without a mate
+    FILE *fp = fopen(right, "w");
+    char rec[128];
+    char expect[MATES * 128] = "";
+    for (int k = MATES; k >= 0 && fp != NULL; k--) {
+        mate_record(rec, sizeof(rec), k == 0 ? 2000 : k, 2);
+        fputs(rec, fp);
+        if (k > 0) {
+            mate_record(rec, sizeof(rec), k, 1);
+            strcat(expect, rec);
+        }
+    }
+    if (fp == NULL || fclose(fp) != 0) {
+        fprintf(stderr, "Can't write %s\n", right);
+        return 1;
+    }
+
+    struct options opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.tablesize = 1009;
+    opt.order = ORDER_RIGHT;
+    opt.index = index;
+    opt.threads = 1;
+    opt.huge_pages = HUGE_PAGES_OFF;
+    opt.splitspace = true;
+    opt.deduplicate = true;
+    opt.metrics = calloc(1, sizeof(struct metrics));
+    struct pair_result res;
+    if (pair_files(left, right, &opt, &res) != FQP_OK) {
+        fprintf(stderr, "%s\n", res.error);
+        return 1;
+    }
+    struct run_counters *c = &res.counts;
+    printf("%s index: %llu bytes, %llu records and %llu duplicates in the first file; %llu pairs, %llu and %llu singles\n",
+           index == INDEX_MPHF ? "mphf" : "hash", (unsigned long long) c->left_bytes,
+           (unsigned long long) c->left_records, (unsigned long long) c->left_duplicates,
+           (unsigned long long) c->left_paired, (unsigned long long) c->left_single, (unsigned long long) c->right_single);
+    int status = 0;
+    if (c->left_bytes <= UINT32_MAX || c->left_records != PAD_RECORDS + MATES + 1 ||
+        c->left_duplicates != PAD_RECORDS - 1 || c->left_paired != MATES || c->right_paired != MATES ||
+        c->left_single != 2 || c->right_single != 1 || c->left_seeks < MATES) {
+        fprintf(stderr, "The counts are wrong\n");
+        status = 1;
+    }
+
+    // the mates came from past 4 GB, and must be the right records
+    char got[sizeof(expect)] = "";
+    fp = fopen(paired, "r");
+    size_t len = fp != NULL ? fread(got, 1, sizeof(got) - 1, fp) : 0;
+    if (fp != NULL)
+        fclose(fp);
+    got[len] = '\0';
+    if (strcmp(got, expect) != 0) {
+        fprintf(stderr, "%s is\n%s\nand not\n%s\n", paired, got, expect);
+        status = 1;
+    }
+    free(opt.metrics);
+    unlink(left);
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "pair") == 0) {
+        const char *dir = argc > 2 ? argv[2] : ".";
+        int status = pair_past_4gb(dir, INDEX_HASH);
+        if (status == 0)
+            status = pair_past_4gb(dir, INDEX_MPHF);
+        printf("%s\n", status == 0 ? "PASS" : status == 77 ? "SKIP" : "FAIL");
+        return status;
+    }
+    uint64_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : 5000;
+    size_t bytes = BUCKETS * sizeof(struct idloc *);
+    struct idloc **table = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (table == MAP_FAILED) {
+        printf("SKIP: can't map a table of %llu buckets\n", (unsigned long long) BUCKETS);
+        return 77;
+    }
+    struct arena ids;
+    arena_init(&ids, 0, HUGE_PAGES_OFF);
+
+    char id[64];
+    uint64_t high = 0;
+    for (uint64_t k = FIRST_READ; k < FIRST_READ + n; k++) {
+        snprintf(id, sizeof(id), "@read%llu", (unsigned long long) k);
+        uint64_t bucket = hash(id) % BUCKETS;
+        if (bucket > UINT32_MAX)
+            high++;
+        if (insert_id(&ids, &table[bucket], id, (long) (k * RECORD_BYTES)) == NULL) {
+            fprintf(stderr, "Can't allocate memory for %s\n", id);
+            return 1;
+        }
+    }
+
+    int status = 0;
+    uint64_t found = 0, missing = 0;
+    for (uint64_t k = FIRST_READ; k < FIRST_READ + 2 * n; k++) {
+        snprintf(id, sizeof(id), "@read%llu", (unsigned long long) k);
+        struct idloc *ptr = find_id(table[hash(id) % BUCKETS], id);
+        if (k < FIRST_READ + n) {
+            if (ptr == NULL || (uint64_t) ptr->pos != k * RECORD_BYTES) {
+                fprintf(stderr, "%s is %s\n", id, ptr == NULL ? "missing" : "at the wrong position");
+                status = 1;
+            } else {
+                found++;
+            }
+        } else if (ptr != NULL) {
+            fprintf(stderr, "%s was found but never added\n", id);
+            status = 1;
+        } else {
+            missing++;
+        }
+    }
+
+    // a third of the buckets are past 2^32, and a 32 bit hash can never reach them
+    printf("%llu of %llu reads in buckets past 2^32\n", (unsigned long long) high, (unsigned long long) n);
+    printf("%llu found, %llu correctly missing\n", (unsigned long long) found, (unsigned long long) missing);
+    if (high < n / 4) {
+        fprintf(stderr, "Too few buckets past 2^32: the hash is not spreading over 64 bits\n");
+        status = 1;
+    }
+
+    arena_free(&ids);
+    munmap(table, bytes);
+    printf("%s\n", status == 0 ? "PASS" : "FAIL");
+    return status;
+}